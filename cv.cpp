@@ -15,22 +15,56 @@
  *   cv
  *
  * Execute (defaults):
- *   cv --cpus 4 --file-out cv_out.dat --format human \
- "      --init-pattern minstd --init-seed 0 --length 268435456 --rounds 4
+ *   cv --cpus 4 --engine inplace --file-out cv_out.dat --format human \
+ "      --init-pattern minstd --init-seed 0 --kernel auto --length 268435456 \
+ "      --alloc plain --memory-budget 16G --pin none --rounds 4 --tile 512 \
+ "      --write async
  *
  * The length is chosen so that it uses 2 GiB on 64-bit machines
  * and 1 GiB on 32-bit machines.
  * For all options and their explanations, run it with --help.
  */
 
+#include <algorithm>
 #include <cassert>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
 #include <random>
+#include <stdexcept>
 #include <string>
 #include <thread>
 #include <vector>
 
+#include "cv.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CV_HAVE_X86_KERNELS 1
+#endif
+
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#define CV_HAVE_AFFINITY 1
+#define CV_HAVE_HUGE_PAGES 1
+#define CV_HAVE_PERF 1
+#endif
+
 /* I know, cstdio isn't really C++11-ish. However, it feels more appropriate. */
 
 
@@ -38,53 +72,1157 @@
 
 /* If you ever want to use this as part of your
  * why-the-hell-would-you-need-to-emulate-cole-vishkin-implementation,
- * feel free to copy the following into a header file and access the
+ * use cv_context from cv.h, see the Library section below. For everything
+ * else, feel free to copy the following into a header file and access the
  * functionality through it: */
 
 extern const std::string cv_about;
 typedef void (*cv_fill_fn_t)(size_t*,size_t,size_t);
+typedef void (*cv_seek_fn_t)(size_t*,size_t,size_t);
+typedef void (*cv_generate_fn_t)(size_t*,size_t*,size_t);
+class cv_stream {
+public:
+    const char* name;
+    cv_seek_fn_t seek;
+    cv_generate_fn_t generate;
+    /* If false, seek only supports position 0. */
+    bool can_skip;
+};
 extern cv_fill_fn_t cv_default_fill;
+extern const cv_stream* cv_default_stream;
+typedef void (*cv_round_fn_t)(size_t*,size_t);
+typedef void (*cv_round_narrow_fn_t)(unsigned char*,const size_t*,size_t);
+typedef void (*cv_round_byte_fn_t)(unsigned char*,size_t);
+typedef void (*cv_narrow_fn_t)(unsigned char*,const size_t*,size_t);
+typedef void (*cv_reduce_fn_t)(unsigned char*,size_t,unsigned char*);
+class cv_kernel {
+public:
+    const char* name;
+    cv_round_fn_t round;
+    cv_round_narrow_fn_t round_narrow;
+    cv_round_byte_fn_t round_byte;
+    cv_narrow_fn_t narrow;
+    cv_reduce_fn_t reduce;
+};
+extern const cv_kernel* cv_default_kernel;
+/* 'auto' is cv_default_kernel. Fails for kernels the CPU can't run. */
+const char* cv_find_kernel(const std::string& name, const cv_kernel*& into);
+enum class cv_engine { inplace, narrow, fused, stream, list, forest };
+enum class cv_alloc { plain, thp, hugetlb, hugetlb1g };
+enum class cv_write { sync, async, direct, mmap };
+enum class cv_encoding { byte, packed3, base6 };
+extern const char* const cv_engine_names[];
+extern const char* const cv_write_names[];
+extern const char* const cv_encoding_names[];
+/* The packed encodings start with this header. 'byte' has none, for
+ * compatibility. */
+static const size_t cv_header_size = 32;
+extern const char* const cv_alloc_names[];
 extern const std::string cv_output_format_none;
 extern const std::string cv_output_format_human;
 extern const std::string cv_output_format_tdl;
+extern const std::string cv_output_format_json;
+extern const std::string cv_output_format_csv;
 class cv_opts {
 public:
     size_t cpus = 4;
     std::string file_out_name = "cv_out.dat";
     cv_fill_fn_t init_pattern_fn = cv_default_fill;
+    const cv_stream* init_stream = cv_default_stream;
+    const cv_kernel* kernel = cv_default_kernel;
+    cv_engine engine = cv_engine::inplace;
+    cv_alloc alloc = cv_alloc::plain;
+    bool prefault = false;
+    bool perf_counters = false;
+    cv_write write = cv_write::async;
+    cv_encoding encoding = cv_encoding::byte;
     size_t init_seed = 0;
     size_t length = 268435456;
     size_t rounds = 4;
+    /* With --rounds auto, 'rounds' is only the most it could take, and the
+     * runner picks the actual number from the colors. */
+    bool rounds_auto = false;
+    size_t tile = 512;
+    /* For the list and forest engines: each node is shuffled within its
+     * window of this many nodes, 0 meaning the whole list. Or the
+     * successors (or parents) come from a file. */
+    size_t list_locality = 0;
+    std::string list_file_name;
+    /* For the forest engine: the depth of each tree (0 means just one
+     * tree), and the average number of children. */
+    size_t forest_depth = 0;
+    size_t forest_fanout = 2;
+    /* Reduce the 6 colors to 3 right after the rounds. */
+    bool three_colors = false;
+    unsigned long long memory_budget = 1ULL << 34;
+    bool length_force = false;
+    /* Worker i runs on pin_cpus[i % size]. Empty means "don't pin". */
+    std::vector<int> pin_cpus;
+    std::string jobs_file_name;
     std::string output_format = cv_output_format_human;
+    /* See --bench. No trials means no benchmark. */
+    size_t bench_trials = 0;
+    size_t bench_warmup = 1;
+    std::string bench_baseline;
+    std::string bench_save;
+    std::vector<std::string> sweeps;
+};
+/* A fixed set of worker threads, which sleep until there's work.
+ * run() hands task(0) to worker 0, task(1) to worker 1, and so on, and
+ * returns once all of them are done. */
+class cv_pool {
+public:
+    explicit cv_pool(const size_t threads,
+                     const std::vector<int>& pin_cpus = std::vector<int>());
+    ~cv_pool();
+    cv_pool(const cv_pool&) = delete;
+    cv_pool& operator=(const cv_pool&) = delete;
+    size_t size() const { return workers.size(); }
+    void run(const size_t n, const std::function<void(size_t)>& task);
+private:
+    void work(const size_t id);
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void(size_t)>* task = nullptr;
+    size_t active = 0;
+    size_t pending = 0;
+    size_t generation = 0;
+    bool quit = false;
+};
+/* Writes pieces of the output file in the background, in any order, with
+ * one thread doing pwrite. */
+class cv_writer {
+public:
+    cv_writer() = default;
+    ~cv_writer();
+    cv_writer(const cv_writer&) = delete;
+    cv_writer& operator=(const cv_writer&) = delete;
+    /* With 'direct', the page-aligned parts bypass the page cache. */
+    const char* open(const std::string& file_out_name, const bool direct);
+    /* False for pipes and the like, which can only be written in order. */
+    bool seekable() const { return can_seek; }
+    /* Queues 'length' bytes for the given file offset. The data must stay
+     * valid until it's written, see drain(). Can be called by any thread. */
+    void submit(const unsigned char* const data, const size_t length,
+                const size_t offset);
+    /* Waits until at most 'max_pending' submitted pieces aren't written. */
+    void drain(const size_t max_pending = 0);
+    /* Writes everything, and closes the file. */
+    const char* close();
+private:
+    class piece {
+    public:
+        const unsigned char* data;
+        size_t length;
+        size_t offset;
+    };
+    void work();
+    bool write_piece(const piece& p) const;
+    int fd = -1;
+    int direct_fd = -1;
+    bool can_seek = false;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::deque<piece> queue;
+    size_t pending = 0;
+    bool quit = false;
+    const char* err = nullptr;
+};
+/* The output file, mapped into memory. For anything but regular files,
+ * open() succeeds without mapping anything, see data(). */
+class cv_mapping {
+public:
+    cv_mapping() = default;
+    ~cv_mapping();
+    cv_mapping(const cv_mapping&) = delete;
+    cv_mapping& operator=(const cv_mapping&) = delete;
+    /* Truncates the file to exactly 'bytes' bytes, and maps all of it. */
+    const char* open(const std::string& file_out_name, const size_t bytes);
+    unsigned char* data() const { return map; }
+    const char* close();
+private:
+    int fd = -1;
+    unsigned char* map = nullptr;
+    size_t size = 0;
+};
+/* Called by a worker for [from, to) as soon as its colors are final. */
+typedef std::function<void(size_t,size_t)> cv_chunk_done_fn_t;
+/* Hardware events, see --perf-counters. */
+static const size_t cv_perf_events = 5;
+extern const char* const cv_perf_names[];
+class cv_counts {
+public:
+    uint64_t value[cv_perf_events] = {};
+    /* As read by cv_perf: how long each event was enabled, and how long it
+     * actually counted. Sums made by add_counts() don't need them. */
+    uint64_t enabled[cv_perf_events] = {};
+    uint64_t running[cv_perf_events] = {};
+};
+/* Counts the events of some threads, and can be read from any thread.
+ * Events which the kernel (or the CPU) doesn't allow are just missing. */
+class cv_perf {
+public:
+    cv_perf() = default;
+    ~cv_perf();
+    cv_perf(const cv_perf&) = delete;
+    cv_perf& operator=(const cv_perf&) = delete;
+    /* Fails only if none of the events can be counted at all. */
+    const char* open(const std::vector<long>& tids);
+    bool has(const size_t event) const { return available[event]; }
+    /* One cv_counts per thread, in the order given to open(). */
+    void read(std::vector<cv_counts>& into) const;
+private:
+    size_t threads = 0;
+    std::vector<int> fds;
+    bool available[cv_perf_events] = {};
+};
+/* Where a worker spent its time, in nanoseconds. For run_chunk, 'setup' is
+ * the staircase at the beginning, 'main' the loop, and 'finish' the part
+ * that needs 'following'. 'narrow' is whatever happens to the chunk after
+ * that: narrowing it, and handing it to the writer. */
+class cv_thread_times {
+public:
+    uint64_t ns_setup = 0;
+    uint64_t ns_main = 0;
+    uint64_t ns_finish = 0;
+    uint64_t ns_narrow = 0;
+    /* The CV phase, only with --perf-counters. */
+    cv_counts perf;
+};
+/* Collects the times of the engines' internals. Everything adds up, so
+ * the streaming engine can use the same one for all its windows. */
+class cv_profile {
+public:
+    uint64_t ns_fill = 0;
+    uint64_t ns_borders = 0;
+    std::vector<cv_thread_times> threads;
+};
+class cv_times {
+public:
+    size_t ms_init = 0;
+    size_t ms_cv = 0;
+    size_t ms_cleanup = 0;
+    size_t ms_all = 0;
+    /* The same, in more detail. Cleanup is 'pack' plus 'write'. */
+    uint64_t ns_alloc = 0;
+    uint64_t ns_fill = 0;
+    uint64_t ns_borders = 0;
+    uint64_t ns_cv = 0;
+    uint64_t ns_pack = 0;
+    uint64_t ns_write = 0;
+    uint64_t ns_all = 0;
+    /* The rounds that were actually run, see --rounds auto. */
+    size_t rounds = 0;
+    std::vector<cv_thread_times> threads;
+    /* Only with --perf-counters. Summed over the pool and the main thread,
+     * but not the background writer. */
+    bool perf = false;
+    bool perf_has[cv_perf_events] = {};
+    cv_counts perf_fill;
+    cv_counts perf_cv;
+    cv_counts perf_write;
+};
+/* Owns a pool and the color buffers, so that several runs in a row only pay
+ * for threads and page faults once. */
+class cv_runner {
+public:
+    explicit cv_runner(const size_t threads,
+                       const std::vector<int>& pin_cpus = std::vector<int>());
+    ~cv_runner();
+    cv_runner(const cv_runner&) = delete;
+    cv_runner& operator=(const cv_runner&) = delete;
+    /* Makes sure the buffers are large enough for 'opts', and allocated the
+     * way it says. With 'prefault', the pool touches every new page right
+     * away. */
+    const char* reserve(const cv_opts& opts, const bool prefault = false);
+    /* Needs a call to reserve() with these opts first. */
+    const char* run(const cv_opts& opts, cv_times& times);
+    /* How long reserve() spent on prefaulting, in total. */
+    size_t ms_prefault() const { return prefault_ms; }
+private:
+    cv_pool pool;
+    size_t* colors = nullptr;
+    size_t colors_length = 0;
+    cv_alloc colors_alloc = cv_alloc::plain;
+    unsigned char* small = nullptr;
+    size_t small_length = 0;
+    cv_alloc small_alloc = cv_alloc::plain;
+    /* The packed encodings need somewhere to put their result. */
+    unsigned char* packed = nullptr;
+    size_t packed_length = 0;
+    /* Only for the list engine. */
+    size_t* successors = nullptr;
+    size_t successors_length = 0;
+    cv_alloc successors_alloc = cv_alloc::plain;
+    unsigned char* scratch = nullptr;
+    size_t scratch_length = 0;
+    cv_alloc scratch_alloc = cv_alloc::plain;
+    size_t prefault_ms = 0;
+    /* Opened by the first run that wants it. The last thread is the one
+     * calling run(), the others are the pool's. */
+    cv_perf perf;
+    bool perf_tried = false;
+    bool perf_works = false;
 };
 const char* cv_try_parse(cv_opts& into, const int argc, char** const argv);
+/* Replaces each job by one copy per value of each --sweep. */
+const char* cv_expand_sweeps(const std::vector<std::string>& sweeps,
+                             std::vector<cv_opts>& jobs);
+/* Robust statistics over the trials of --bench. */
+class cv_stats {
+public:
+    double median = 0;
+    /* Median absolute deviation. */
+    double mad = 0;
+    /* Half the width of the 95% confidence interval of the median. */
+    double ci = 0;
+    size_t outliers = 0;
+};
+cv_stats cv_compute_stats(std::vector<double> samples);
+/* Runs each job as --bench says, and prints the results. 'regressed' is
+ * set if any job got significantly slower than the baseline. */
+const char* cv_bench(cv_runner& runner, const std::vector<cv_opts>& jobs,
+                     const cv_opts& opts, bool& regressed);
+const char* cv_pin_order(const std::string& how, std::vector<int>& into);
+const char* cv_validate(const cv_opts& opts);
+const char* cv_try_parse_jobs(const cv_opts& base, std::vector<cv_opts>& into);
+unsigned long long cv_memory_needed(const cv_opts& opts);
+size_t cv_group_nodes(const cv_encoding encoding);
+size_t cv_encoded_size(const size_t length, const cv_encoding encoding);
+void cv_encode_header(unsigned char* const into, const cv_encoding encoding,
+                      const size_t length, const size_t rounds,
+                      const size_t seed);
+const char* cv_decode_header(const unsigned char* const from,
+                             cv_encoding& encoding, size_t& length,
+                             size_t& rounds, size_t& seed);
+void cv_pack(unsigned char* const out, const unsigned char* const in,
+             const size_t count, const cv_encoding encoding);
+void cv_unpack(unsigned char* const out, const unsigned char* const in,
+               const size_t count, const cv_encoding encoding);
+void cv_pack_parallel(unsigned char* const out, const unsigned char* const in,
+                      const size_t count, const cv_encoding encoding,
+                      const size_t cpus, cv_pool* const pool = nullptr);
+void* cv_allocate(const size_t bytes, const cv_alloc how);
+void cv_deallocate(void* const data, const size_t bytes, const cv_alloc how);
+/* With 'combined', also ORs all colors together into it, which is all that
+ * --rounds auto needs to know. */
+void cv_fill_parallel(size_t* const begin, const size_t length,
+                      const size_t cpus, const size_t seed,
+                      cv_fill_fn_t fill_fn, const cv_stream* stream,
+                      cv_pool* const pool = nullptr,
+                      size_t* const combined = nullptr);
+size_t cv_combine_parallel(const size_t* const begin, const size_t length,
+                           const size_t cpus, cv_pool* const pool = nullptr);
+/* How many rounds it takes until the colors are in 0..5, if the OR of all
+ * of them is 'combined'. At least one, though. */
+size_t cv_rounds_for(const size_t combined);
 void cv_start_and_join_workers(size_t* const begin, const size_t length,
-                             const size_t cpus, const size_t rounds);
+                             const size_t cpus, const size_t rounds,
+                             const cv_kernel* kernel = cv_default_kernel,
+                             const size_t tile = 512,
+                             unsigned char* const narrow_out = nullptr,
+                             const size_t* const tail = nullptr,
+                             cv_pool* const pool = nullptr,
+                             const bool compact = false,
+                             const cv_chunk_done_fn_t& chunk_done
+                                     = cv_chunk_done_fn_t(),
+                             cv_profile* const profile = nullptr,
+                             const bool three = false);
+/* Writes a ring through all nodes into 'next', where each node is shuffled
+ * within its window of 'locality' nodes (0 for all of them). Needs
+ * 'length' words of 'temp'. With locality 1, next[i] is just i+1. */
+void cv_generate_list(size_t* const next, size_t* const temp,
+                      const size_t length, const size_t locality,
+                      const size_t seed, const size_t cpus,
+                      cv_pool* const pool = nullptr);
+/* Writes random trees into 'parent', level by level: each tree has
+ * 'depth'+1 levels (or as many as it takes, for 0), level l has fanout^l
+ * nodes, and each of them picks its parent at random from level l-1.
+ * Roots are their own parent. Then the nodes are shuffled like for
+ * cv_generate_list. */
+void cv_generate_forest(size_t* const parent, size_t* const temp,
+                        const size_t length, const size_t depth,
+                        const size_t fanout, const size_t locality,
+                        const size_t seed, const size_t cpus,
+                        cv_pool* const pool = nullptr);
+/* Reads the successors as 64-bit numbers in host byte order, and checks
+ * them. With 'roots', nodes may be their own successor, i.e. parent. */
+const char* cv_load_list(const std::string& file_name, size_t* const next,
+                         const size_t length, const bool roots = false);
+/* The successor of node i is next[i], whatever the order. 'out' gets the
+ * final colors, as bytes, and 'scratch' (also bytes) is needed if there's
+ * more than one round. With 'roots', next[i] may be i, and then node i
+ * does what the classic algorithm does for a root: it pretends that its
+ * parent differs in bit 0, and so keeps just that bit. */
+void cv_start_and_join_list(const size_t* const next,
+                            const size_t* const colors, const size_t length,
+                            const size_t cpus, const size_t rounds,
+                            unsigned char* const out,
+                            unsigned char* const scratch,
+                            cv_pool* const pool = nullptr,
+                            const cv_chunk_done_fn_t& chunk_done
+                                    = cv_chunk_done_fn_t(),
+                            cv_profile* const profile = nullptr,
+                            const bool roots = false);
+void cv_start_and_join_fused(const cv_stream* stream, const size_t seed,
+                             const size_t length, const size_t cpus,
+                             const size_t rounds, unsigned char* const out,
+                             const cv_kernel* kernel = cv_default_kernel,
+                             const size_t tile = 512,
+                             cv_pool* const pool = nullptr,
+                             const cv_chunk_done_fn_t& chunk_done
+                                     = cv_chunk_done_fn_t(),
+                             cv_profile* const profile = nullptr);
+const char* cv_start_and_join_streaming(const cv_stream* stream,
+                                        const size_t seed, const size_t length,
+                                        const size_t cpus, const size_t rounds,
+                                        const size_t window,
+                                        const std::string& file_out_name,
+                                        const cv_kernel* kernel = cv_default_kernel,
+                                        const size_t tile = 512,
+                                        cv_pool* const pool = nullptr,
+                                        const cv_write write = cv_write::sync,
+                                        const cv_encoding encoding
+                                                = cv_encoding::byte,
+                                        cv_profile* const profile = nullptr);
 const char* cv_write_file(size_t* const begin, const size_t length,
                           const std::string& file_out_name);
+const char* cv_write_bytes(const unsigned char* const data, const size_t length,
+                           const std::string& file_out_name);
+const char* cv_write_compacted(const size_t* const begin, const size_t length,
+                               const size_t cpus,
+                               const std::string& file_out_name);
+const char* cv_write_encoded(const unsigned char* const header,
+                             const unsigned char* const data,
+                             const size_t bytes,
+                             const std::string& file_out_name);
+/* Once before all jobs, for the formats that need that. */
+void cv_print_header(const cv_opts& opts, const bool prefault,
+                     const size_t ms_prefault);
+void cv_print_times(const cv_opts& opts, const cv_times& times);
 int cv_main(int argc, char **argv, bool print_errors = true);
 /* Note: you can disable the 'main' symbol by compiling with -DCV_NO_MAIN. */
 
 
+/* ===== Timing ===== */
+
+typedef std::chrono::high_resolution_clock my_clock_t;
+
+// explain(clock_finish - clock_init, "<All>");
+static size_t duration_to_ms(const my_clock_t::duration dur) {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(dur).count();
+}
+
+static uint64_t duration_to_ns(const my_clock_t::duration dur) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(dur).count();
+}
+
+
 /* ===== Core algorithm ===== */
 
-static inline void compute_cv(size_t* const which, const size_t* const with) {
+static inline size_t cv_step(const size_t which, const size_t with) {
     /* This feels like it's just two instructions!
      * I'm sure there's an even more efficient implementation
      * using SIMD or something. */
-    size_t xored = *which ^ *with;
+    size_t xored = which ^ with;
     assert(xored);
-    size_t num = __builtin_ctz(xored);
-    size_t orig_bit = 1 & (*which >> num);
-    *which = orig_bit | (num << 1);
+    size_t num = __builtin_ctzll(xored);
+    size_t orig_bit = 1 & (which >> num);
+    return orig_bit | (num << 1);
+}
+
+static inline void compute_cv(size_t* const which, const size_t* const with) {
+    *which = cv_step(*which, *with);
+}
+
+/* A color below 2^w becomes one below 2w, since it's the index of a bit,
+ * times two, plus that bit. That's where the table at --rounds comes from.
+ * The OR has just as many bits as the largest color. */
+size_t cv_rounds_for(const size_t combined) {
+    size_t most = combined ? ~size_t(0) >> __builtin_clzll(combined) : 0;
+    size_t rounds = 0;
+    while (most > 5) {
+        const size_t width = 64 - __builtin_clzll(most);
+        most = 2 * width - 1;
+        ++rounds;
+    }
+    return std::max<size_t>(rounds, 1);
+}
+
+/* ===== Round kernels ===== */
+
+/* A round kernel applies one round of Cole-Vishkin to 'count' consecutive
+ * positions, where the successor of which[i] is which[i+1]. It walks forward,
+ * so it can be (and is) done in-place: which[i+1] is always read before it
+ * gets overwritten. All of these pairs are independent of each other, which
+ * is exactly what SIMD needs.
+ *
+ * Each kernel comes in three flavors:
+ * - round: 64-bit colors, in-place.
+ * - round_narrow: 64-bit colors from 'in', the resulting colors go to 'out'
+ *   as bytes. After one round, every color fits into 7 bits (2*63+1).
+ * - round_byte: like 'round', but on the bytes written by round_narrow.
+ * Plus one that doesn't do a round at all:
+ * - narrow: just truncates the 64-bit colors in 'in' to the bytes in 'out'.
+ *   This must also work in-place, with 'out' pointing to the start of 'in':
+ *   each block is read before anything is written to its (lower) address.
+ * And one for after the rounds:
+ * - reduce: the sweep of the 6-to-3 reduction (see cv_reducer) over 'count'
+ *   positions of bytes. It reads which[-1] to which[count], and writes the
+ *   final colors of which[-2] to which[count-3]. 'lag' holds what passes 5
+ *   and 4 made of the positions before, and is kept up to date. */
+
+static void round_span_scalar(size_t* const which, const size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        compute_cv(which + i, which + (i + 1));
+    }
+}
+
+static void round_narrow_scalar(unsigned char* const out,
+                                const size_t* const in, const size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = static_cast<unsigned char>(cv_step(in[i], in[i + 1]));
+    }
+}
+
+static void round_byte_scalar(unsigned char* const which, const size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        which[i] = static_cast<unsigned char>(cv_step(which[i], which[i + 1]));
+    }
+}
+
+static void narrow_scalar(unsigned char* const out, const size_t* const in,
+                          const size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        out[i] = static_cast<unsigned char>(in[i]);
+    }
+}
+
+#ifdef CV_HAVE_X86_KERNELS
+/* AVX2 has no 64-bit ctz or lzcnt, so count the bits *below* the lowest set
+ * bit instead: ctz(x) == popcount(~x & (x - 1)). The popcount is the usual
+ * nibble-lookup with pshufb, and psadbw sums up the bytes of each lane. */
+__attribute__((target("avx2")))
+static inline __m256i cv_step_avx2(const __m256i self, const __m256i next) {
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+                                         1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3,
+                                         1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i one = _mm256_set1_epi64x(1);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i xored = _mm256_xor_si256(self, next);
+    assert(!_mm256_movemask_epi8(_mm256_cmpeq_epi64(xored, zero)));
+    const __m256i below = _mm256_andnot_si256(xored,
+            _mm256_sub_epi64(xored, one));
+    const __m256i lo = _mm256_and_si256(below, nibble);
+    const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(below, 4), nibble);
+    const __m256i bytes = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo),
+                                          _mm256_shuffle_epi8(lut, hi));
+    const __m256i num = _mm256_sad_epu8(bytes, zero);
+    const __m256i orig_bit = _mm256_and_si256(
+            _mm256_srlv_epi64(self, num), one);
+    return _mm256_or_si256(orig_bit, _mm256_slli_epi64(num, 1));
+}
+
+__attribute__((target("avx2")))
+static void round_span_avx2(size_t* const which, const size_t count) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m256i self = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(which + i));
+        const __m256i next = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(which + (i + 1)));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(which + i),
+                cv_step_avx2(self, next));
+    }
+    round_span_scalar(which + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void round_narrow_avx2(unsigned char* const out,
+                              const size_t* const in, const size_t count) {
+    /* Move the low byte of each 64-bit lane to the bottom of its
+     * 128-bit half, then glue the two halves together. */
+    const __m256i pick = _mm256_setr_epi8(0, 8, -1, -1, -1, -1, -1, -1,
+                                          -1, -1, -1, -1, -1, -1, -1, -1,
+                                          0, 8, -1, -1, -1, -1, -1, -1,
+                                          -1, -1, -1, -1, -1, -1, -1, -1);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        const __m256i self = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(in + i));
+        const __m256i next = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(in + (i + 1)));
+        const __m256i picked = _mm256_shuffle_epi8(
+                cv_step_avx2(self, next), pick);
+        const uint32_t four = static_cast<uint32_t>(
+                _mm_cvtsi128_si32(_mm256_castsi256_si128(picked)) & 0xffff)
+                | static_cast<uint32_t>(
+                _mm_cvtsi128_si32(_mm256_extracti128_si256(picked, 1)) << 16);
+        memcpy(out + i, &four, sizeof(four));
+    }
+    round_narrow_scalar(out + i, in + i, count - i);
+}
+
+/* With bytes, there are no variable shifts, but there's no need for them:
+ * the original bit is set iff 'self' has the isolated lowest bit set. */
+__attribute__((target("avx2")))
+static void round_byte_avx2(unsigned char* const which, const size_t count) {
+    const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+                                         1, 2, 2, 3, 2, 3, 3, 4,
+                                         0, 1, 1, 2, 1, 2, 2, 3,
+                                         1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        const __m256i self = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(which + i));
+        const __m256i next = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(which + (i + 1)));
+        const __m256i xored = _mm256_xor_si256(self, next);
+        assert(!_mm256_movemask_epi8(_mm256_cmpeq_epi8(xored, zero)));
+        const __m256i lowest = _mm256_and_si256(xored,
+                _mm256_sub_epi8(zero, xored));
+        const __m256i below = _mm256_sub_epi8(lowest, one);
+        const __m256i lo = _mm256_and_si256(below, nibble);
+        const __m256i hi = _mm256_and_si256(_mm256_srli_epi16(below, 4), nibble);
+        const __m256i num = _mm256_add_epi8(_mm256_shuffle_epi8(lut, lo),
+                                            _mm256_shuffle_epi8(lut, hi));
+        const __m256i orig_bit = _mm256_min_epu8(
+                _mm256_and_si256(self, lowest), one);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(which + i),
+                _mm256_or_si256(orig_bit, _mm256_add_epi8(num, num)));
+    }
+    round_byte_scalar(which + i, count - i);
+}
+
+/* Same trick as in round_narrow_avx2, but for 16 colors at once: the k-th
+ * vector ends up in bytes 2k and 2k+1 of each 128-bit half, and
+ * interleaving the halves puts everything in order. */
+__attribute__((target("avx2")))
+static void narrow_avx2(unsigned char* const out, const size_t* const in,
+                        const size_t count) {
+    const __m256i pick = _mm256_setr_epi8(0, 8, -1, -1, -1, -1, -1, -1,
+                                          -1, -1, -1, -1, -1, -1, -1, -1,
+                                          0, 8, -1, -1, -1, -1, -1, -1,
+                                          -1, -1, -1, -1, -1, -1, -1, -1);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const __m256i* const src = reinterpret_cast<const __m256i*>(in + i);
+        const __m256i a = _mm256_shuffle_epi8(_mm256_loadu_si256(src), pick);
+        const __m256i b = _mm256_shuffle_epi8(_mm256_loadu_si256(src + 1), pick);
+        const __m256i c = _mm256_shuffle_epi8(_mm256_loadu_si256(src + 2), pick);
+        const __m256i d = _mm256_shuffle_epi8(_mm256_loadu_si256(src + 3), pick);
+        const __m256i all = _mm256_or_si256(
+                _mm256_or_si256(a, _mm256_slli_si256(b, 2)),
+                _mm256_or_si256(_mm256_slli_si256(c, 4),
+                                _mm256_slli_si256(d, 6)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i),
+                _mm_unpacklo_epi16(_mm256_castsi256_si128(all),
+                                   _mm256_extracti128_si256(all, 1)));
+    }
+    narrow_scalar(out + i, in + i, count - i);
+}
+
+/* AVX-512CD has vplzcntq, and for the isolated lowest bit b = x & -x,
+ * ctz(x) == 63 - lzcnt(b). Tails are done with masked loads and stores. */
+__attribute__((target("avx512f,avx512cd")))
+static inline __m512i cv_step_avx512(const __mmask8 mask, const __m512i self,
+                                     const __m512i next) {
+    const __m512i one = _mm512_set1_epi64(1);
+    const __m512i sixty_three = _mm512_set1_epi64(63);
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i xored = _mm512_xor_si512(self, next);
+    assert(!_mm512_mask_cmpeq_epi64_mask(mask, xored, zero));
+    const __m512i lowest = _mm512_and_si512(xored,
+            _mm512_sub_epi64(zero, xored));
+    const __m512i num = _mm512_sub_epi64(sixty_three,
+            _mm512_lzcnt_epi64(lowest));
+    const __m512i orig_bit = _mm512_and_si512(
+            _mm512_maskz_srlv_epi64(mask, self, num), one);
+    return _mm512_or_si512(orig_bit, _mm512_maskz_slli_epi64(mask, num, 1));
+}
+
+static inline __mmask8 tail_mask8(const size_t remaining) {
+    return (remaining >= 8) ? 0xff
+            : static_cast<__mmask8>((1u << remaining) - 1);
+}
+
+__attribute__((target("avx512f,avx512cd")))
+static void round_span_avx512(size_t* const which, const size_t count) {
+    for (size_t i = 0; i < count; i += 8) {
+        const __mmask8 mask = tail_mask8(count - i);
+        const __m512i self = _mm512_maskz_loadu_epi64(mask, which + i);
+        const __m512i next = _mm512_maskz_loadu_epi64(mask, which + (i + 1));
+        _mm512_mask_storeu_epi64(which + i, mask,
+                cv_step_avx512(mask, self, next));
+    }
+}
+
+/* vpmovqb does the narrowing all by itself. */
+__attribute__((target("avx512f,avx512cd")))
+static void round_narrow_avx512(unsigned char* const out,
+                                const size_t* const in, const size_t count) {
+    for (size_t i = 0; i < count; i += 8) {
+        const __mmask8 mask = tail_mask8(count - i);
+        const __m512i self = _mm512_maskz_loadu_epi64(mask, in + i);
+        const __m512i next = _mm512_maskz_loadu_epi64(mask, in + (i + 1));
+        _mm512_mask_cvtepi64_storeu_epi8(out + i, mask,
+                cv_step_avx512(mask, self, next));
+    }
+}
+
+__attribute__((target("avx512f")))
+static void narrow_avx512(unsigned char* const out, const size_t* const in,
+                          const size_t count) {
+    for (size_t i = 0; i < count; i += 8) {
+        const __mmask8 mask = tail_mask8(count - i);
+        _mm512_mask_cvtepi64_storeu_epi8(out + i, mask,
+                _mm512_maskz_loadu_epi64(mask, in + i));
+    }
+}
+#endif
+
+/* See '6 to 3 colors' below. */
+static void reduce_scalar(unsigned char* const which, const size_t count,
+                          unsigned char* const lag);
+#ifdef CV_HAVE_X86_KERNELS
+static void reduce_avx2(unsigned char* const which, const size_t count,
+                        unsigned char* const lag);
+#endif
+
+static const cv_kernel cv_kernel_scalar = {
+    "scalar", round_span_scalar, round_narrow_scalar, round_byte_scalar,
+    narrow_scalar, reduce_scalar
+};
+#ifdef CV_HAVE_X86_KERNELS
+static const cv_kernel cv_kernel_avx2 = {
+    "avx2", round_span_avx2, round_narrow_avx2, round_byte_avx2, narrow_avx2,
+    reduce_avx2
+};
+/* Byte rounds and the reduction would need AVX-512BW, and are cheap
+ * anyway. */
+static const cv_kernel cv_kernel_avx512 = {
+    "avx512", round_span_avx512, round_narrow_avx512, round_byte_avx2,
+    narrow_avx512, reduce_avx2
+};
+#endif
+
+static const cv_kernel* detect_kernel() {
+#ifdef CV_HAVE_X86_KERNELS
+    /* Static initialization may run before gcc's own CPU detection. */
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512cd")) {
+        return &cv_kernel_avx512;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return &cv_kernel_avx2;
+    }
+#endif
+    return &cv_kernel_scalar;
+}
+
+const cv_kernel* cv_default_kernel = detect_kernel();
+
+const char* cv_find_kernel(const std::string& name, const cv_kernel*& into) {
+    if ("auto" == name) {
+        into = cv_default_kernel;
+    } else if ("scalar" == name) {
+        into = &cv_kernel_scalar;
+#ifdef CV_HAVE_X86_KERNELS
+    } else if ("avx2" == name) {
+        if (!__builtin_cpu_supports("avx2")) {
+            return "This CPU doesn't support the 'avx2' kernel.";
+        }
+        into = &cv_kernel_avx2;
+    } else if ("avx512" == name) {
+        if (!__builtin_cpu_supports("avx512f")
+                || !__builtin_cpu_supports("avx512cd")) {
+            return "This CPU doesn't support the 'avx512' kernel.";
+        }
+        into = &cv_kernel_avx512;
+#endif
+    } else {
+        return "Only 'auto', 'scalar', 'avx2', and 'avx512' are"
+                " supported as --kernel, sorry.";
+    }
+    return nullptr;
+}
+
+/* run_chunk works on one of two representations:
+ * - in-place: 'in == out', and T is size_t.
+ * - narrow: the original colors are read from 'in', and everything after the
+ *   first round lives in 'out', where T is unsigned char. 'in' is never
+ *   written to, and only read once.
+ * Either way, a position which hasn't seen any round yet is read from 'in',
+ * and everything else is read from and written to 'out'. */
+
+static inline void kernel_first(const cv_kernel* const kernel,
+                                size_t* const out, const size_t* const in,
+                                const size_t count) {
+    assert(in == out);
+    (void)in;
+    kernel->round(out, count);
+}
+
+static inline void kernel_first(const cv_kernel* const kernel,
+                                unsigned char* const out,
+                                const size_t* const in, const size_t count) {
+    kernel->round_narrow(out, in, count);
+}
+
+static inline void kernel_next(const cv_kernel* const kernel,
+                               size_t* const which, const size_t count) {
+    kernel->round(which, count);
+}
+
+static inline void kernel_next(const cv_kernel* const kernel,
+                               unsigned char* const which, const size_t count) {
+    kernel->round_byte(which, count);
+}
+
+#ifndef CV_NO_SPECIALIZE
+/* The classic position-by-position main loop of run_chunk (see there),
+ * with the number of rounds known at compile time. I'm not sure whether an
+ * explicit loop can be unrolled by gcc, so let the templates do it.
+ *
+ * The generic loop loads and stores begin[p..p+rounds] for every p, although
+ * all but one of these values were just computed. Here, 'window' holds
+ * begin[p..p+Rounds-1] instead, which lives in registers once everything is
+ * unrolled, so each position costs exactly one load and one store. */
+template <size_t I>
+struct pipeline_step {
+    /* 'with' is the already updated successor of window[I-1].
+     * Returns the new color of window[0], and shifts the window by one. */
+    static inline size_t run(size_t* const __restrict window,
+                             const size_t with) {
+        const size_t updated = cv_step(window[I - 1], with);
+        window[I - 1] = with;
+        return pipeline_step<I - 1>::run(window, updated);
+    }
+};
+
+template <>
+struct pipeline_step<0> {
+    static inline size_t run(size_t* const __restrict, const size_t with) {
+        return with;
+    }
+};
+
+/* Where run_pipeline reads the original colors from. In-place, that's
+ * 'out' itself, so that no color is ever accessed through both 'in' and
+ * 'out', as the __restrict promises. */
+static inline const size_t* pipeline_source(const size_t* const in,
+                                            size_t* const out) {
+    assert(in == out);
+    (void)in;
+    return out;
+}
+
+static inline const size_t* pipeline_source(const size_t* const in,
+                                            unsigned char* const) {
+    return in;
+}
+
+/* Without the __restrict, gcc has to assume that storing out[p] may change
+ * the original color of p + Rounds, and reloads it. */
+template <typename T, size_t Rounds>
+static void run_pipeline(const size_t* const __restrict in,
+                         T* const __restrict out,
+                         const size_t completable_end) {
+    const size_t* const source = pipeline_source(in, out);
+    /* The last position in the window has its original color. */
+    size_t window[Rounds];
+    std::copy(out, out + (Rounds - 1), window);
+    window[Rounds - 1] = source[Rounds - 1];
+    for (size_t p = 0; p < completable_end; ++p) {
+        out[p] = static_cast<T>(
+                pipeline_step<Rounds>::run(window, source[p + Rounds]));
+    }
+    /* Hand the established positions back to "finishing up". */
+    std::copy(window, window + (Rounds - 1), out + completable_end);
+}
+
+/* The walks of the skewed wavefront (see run_chunk) after the first one,
+ * for a tile starting at 'at'. */
+template <typename T, size_t I>
+struct wavefront_walk {
+    static inline void run(const cv_kernel* const kernel, T* const at,
+                           const size_t width) {
+        kernel_next(kernel, at + (I - 1), width);
+        wavefront_walk<T, I - 1>::run(kernel, at, width);
+    }
+};
+
+template <typename T>
+struct wavefront_walk<T, 0> {
+    static inline void run(const cv_kernel* const, T* const, const size_t) {
+    }
+};
+
+/* The skewed wavefront of run_chunk over [begin, end), with the number of
+ * rounds known at compile time, like run_pipeline. */
+template <typename T, size_t Rounds>
+static void run_wavefront(const size_t* const in, T* const out,
+                          const size_t begin, const size_t end,
+                          const cv_kernel* const kernel, const size_t tile) {
+    for (size_t q = begin; q < end; q += tile) {
+        const size_t width = std::min(tile, end - q);
+        const size_t first = q + (Rounds - 1);
+        kernel_first(kernel, out + first, in + first, width);
+        wavefront_walk<T, Rounds - 1>::run(kernel, out + q, width);
+    }
+}
+
+/* The main loop of run_chunk over [begin, end), for both kinds of tiles. */
+template <typename T, size_t Rounds>
+static void run_main(const size_t* const in, T* const out, const size_t begin,
+                     const size_t end, const cv_kernel* const kernel,
+                     const size_t tile) {
+    if (tile > 1) {
+        run_wavefront<T, Rounds>(in, out, begin, end, kernel, tile);
+    } else {
+        run_pipeline<T, Rounds>(in + begin, out + begin, end - begin);
+    }
+}
+
+/* Returns false if there's no specialization for this many rounds. */
+template <typename T>
+static bool run_main_specialized(const size_t* const in, T* const out,
+                                 const size_t begin, const size_t end,
+                                 const cv_kernel* const kernel,
+                                 const size_t tile, const size_t rounds) {
+    switch (rounds) {
+    case 1: run_main<T, 1>(in, out, begin, end, kernel, tile); return true;
+    case 2: run_main<T, 2>(in, out, begin, end, kernel, tile); return true;
+    case 3: run_main<T, 3>(in, out, begin, end, kernel, tile); return true;
+    case 4: run_main<T, 4>(in, out, begin, end, kernel, tile); return true;
+    case 5: run_main<T, 5>(in, out, begin, end, kernel, tile); return true;
+    case 6: run_main<T, 6>(in, out, begin, end, kernel, tile); return true;
+    default: return false;
+    }
+}
+#endif
+
+/* ===== 6 to 3 colors =====
+ * The classic reduction: for each of the colors 5, 4, and 3, all nodes of
+ * that color take the smallest of 0, 1, and 2 that neither neighbor has.
+ * Nodes of the same color are never neighbors, so a pass never changes the
+ * neighbors of the nodes it recolors. Therefore, the pass for color c only
+ * needs the pass for c+1 to be done up to the next position, and all three
+ * go in a single sweep: at position x, pass 5 does x, pass 4 does x-1, and
+ * pass 3 does x-2, which is then final. What passes 5 and 4 made of the
+ * two positions before is kept on the side, in registers.
+ *
+ * This runs on the bytes, right behind run_chunk. A chunk's nodes also see
+ * the colors (after the rounds) of the 3 nodes before and after it, which
+ * the caller computes on the side. */
+
+/* If 'self' is 'color', the smallest of 0, 1, 2 which is neither 'before'
+ * nor 'after'. Written such that gcc doesn't need any branches. */
+template <typename T>
+static inline T cv_recolor(const T before, const T self, const T after,
+                           const T color) {
+    const T free = (before != 0 && after != 0) ? 0
+            : ((before != 1 && after != 1) ? 1 : 2);
+    return self == color ? free : self;
+}
+
+static void reduce_scalar(unsigned char* const which, const size_t count,
+                          unsigned char* const lag) {
+    for (size_t i = 0; i < count; ++i) {
+        const unsigned char p5 = cv_recolor<unsigned char>(which[i - 1],
+                which[i], which[i + 1], 5);
+        const unsigned char p4 = cv_recolor<unsigned char>(lag[0], lag[1],
+                                                           p5, 4);
+        which[i - 2] = cv_recolor<unsigned char>(lag[2], lag[3], p4, 3);
+        lag[0] = lag[1];
+        lag[1] = p5;
+        lag[2] = lag[3];
+        lag[3] = p4;
+    }
 }
 
-static void run_chunk(size_t* const begin, size_t const length,
-                      std::vector<size_t> following) {
+#ifdef CV_HAVE_X86_KERNELS
+__attribute__((target("avx2")))
+static inline __m256i cv_recolor_avx2(const __m256i before,
+                                      const __m256i self,
+                                      const __m256i after,
+                                      const __m256i color) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i has0 = _mm256_or_si256(_mm256_cmpeq_epi8(before, zero),
+                                         _mm256_cmpeq_epi8(after, zero));
+    const __m256i has1 = _mm256_or_si256(_mm256_cmpeq_epi8(before, one),
+                                         _mm256_cmpeq_epi8(after, one));
+    /* The masks are -1, so this is has0 + (has0 && has1). */
+    const __m256i free = _mm256_sub_epi8(_mm256_sub_epi8(zero, has0),
+                                         _mm256_and_si256(has0, has1));
+    return _mm256_blendv_epi8(self, free, _mm256_cmpeq_epi8(self, color));
+}
+
+/* The 32 bytes of pass 5 (and then 4) at once, and those of the previous
+ * vector are the lag. alignr only works within 128-bit halves, so first
+ * put the upper half of 'prev' below the lower half of 'cur'. */
+__attribute__((target("avx2")))
+static void reduce_avx2(unsigned char* const which, const size_t count,
+                        unsigned char* const lag) {
+    const __m256i five = _mm256_set1_epi8(5);
+    const __m256i four = _mm256_set1_epi8(4);
+    const __m256i three = _mm256_set1_epi8(3);
+    /* Only the top two bytes matter. */
+    __m256i lag5 = _mm256_insert_epi16(_mm256_setzero_si256(),
+                                       lag[0] | lag[1] << 8, 15);
+    __m256i lag4 = _mm256_insert_epi16(_mm256_setzero_si256(),
+                                       lag[2] | lag[3] << 8, 15);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        const __m256i p5 = cv_recolor_avx2(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(
+                        which + i - 1)),
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(
+                        which + i)),
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(
+                        which + i + 1)),
+                five);
+        const __m256i glued5 = _mm256_permute2x128_si256(lag5, p5, 0x21);
+        const __m256i p4 = cv_recolor_avx2(
+                _mm256_alignr_epi8(p5, glued5, 14),
+                _mm256_alignr_epi8(p5, glued5, 15), p5, four);
+        const __m256i glued4 = _mm256_permute2x128_si256(lag4, p4, 0x21);
+        const __m256i p3 = cv_recolor_avx2(
+                _mm256_alignr_epi8(p4, glued4, 14),
+                _mm256_alignr_epi8(p4, glued4, 15), p4, three);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(which + i - 2), p3);
+        lag5 = p5;
+        lag4 = p4;
+    }
+    const int top5 = _mm256_extract_epi16(lag5, 15);
+    const int top4 = _mm256_extract_epi16(lag4, 15);
+    lag[0] = static_cast<unsigned char>(top5);
+    lag[1] = static_cast<unsigned char>(top5 >> 8);
+    lag[2] = static_cast<unsigned char>(top4);
+    lag[3] = static_cast<unsigned char>(top4 >> 8);
+    reduce_scalar(which + i, count - i, lag);
+}
+#endif
+
+class cv_reducer {
+public:
+    /* 'context' holds the colors of the 3 nodes before the chunk, and then
+     * those of the 3 nodes after it. */
+    cv_reducer(unsigned char* const out, const size_t length,
+               const size_t* const context, const cv_kernel* const kernel)
+            : out(out), length(length), kernel(kernel) {
+        for (size_t i = 0; i < 2 * margin; ++i) {
+            ghost[i] = context ? static_cast<unsigned char>(context[i]) : 0;
+        }
+    }
+
+    /* Positions [0, complete) of the chunk have their colors from the
+     * rounds now. Makes as many of them final as it can. */
+    void advance(const size_t complete) {
+        /* The nodes after the chunk can be read once the chunk is done. */
+        const size_t readable = complete == length ? length + 2 * margin
+                                                   : complete + margin;
+        /* Pass 5 at x reads x+1, and the last one to recolor is the last
+         * node of the chunk, for pass 3. */
+        const size_t end = std::min(readable - 1, length + 2 * margin - 1);
+        size_t x = next;
+        for (; x < end && x < margin + 2; ++x) {
+            step(x);
+        }
+        /* Away from the edges, the bytes are right there in 'out'. */
+        const size_t fast_end = std::min(end,
+                std::min(readable, length + margin) - 1);
+        if (x < fast_end) {
+            kernel->reduce(out + (x - margin), fast_end - x, lag);
+            x = fast_end;
+        }
+        for (; x < end; ++x) {
+            step(x);
+        }
+        next = x;
+    }
+
+private:
+    static const size_t margin = 3;
+    /* Position x is out[x - margin], so that the nodes before the chunk
+     * are positions 0..2. */
+    void step(const size_t x) {
+        const unsigned char p5 = cv_recolor<unsigned char>(get(x - 1),
+                get(x), get(x + 1), 5);
+        const unsigned char p4 = cv_recolor<unsigned char>(lag[0], lag[1],
+                                                           p5, 4);
+        const unsigned char p3 = cv_recolor<unsigned char>(lag[2], lag[3],
+                                                           p4, 3);
+        if (x >= margin + 2 && x < length + margin + 2) {
+            out[x - 2 - margin] = p3;
+        }
+        lag[0] = lag[1];
+        lag[1] = p5;
+        lag[2] = lag[3];
+        lag[3] = p4;
+    }
+    unsigned char get(const size_t x) const {
+        if (x < margin) {
+            return ghost[x];
+        }
+        if (x >= length + margin) {
+            return ghost[x - length];
+        }
+        return out[x - margin];
+    }
+    unsigned char* const out;
+    const size_t length;
+    const cv_kernel* const kernel;
+    unsigned char ghost[2 * margin];
+    /* Pass 5 of x-2 and x-1, then pass 4 of x-3 and x-2. Before the chunk,
+     * some of these are wrong, but only ever lead to the colors of the
+     * nodes before it, which aren't written. */
+    unsigned char lag[4] = {};
+    /* Pass 5 starts at 1, so that it has a neighbor on both sides. */
+    size_t next = 1;
+};
+
+/* The reducer follows run_chunk in blocks of this many positions, which
+ * are then still in L1. */
+static const size_t reduce_block = 1024;
+
+/* Narrows the colors [from, to) of a chunk to bytes, in-place, to the start
+ * of the chunk. Bytes already are. run_chunk does this with 'three', before
+ * reducing them, and cv_start_and_join_workers with 'compact'. */
+static void narrow_in_place(const cv_kernel* const kernel,
+                            unsigned char* const bytes,
+                            const size_t* const words, const size_t from,
+                            const size_t to) {
+    kernel->narrow(bytes + from, words + from, to - from);
+}
+
+static void narrow_in_place(const cv_kernel* const,
+                            unsigned char* const,
+                            const unsigned char* const, const size_t,
+                            const size_t) {
+}
+
+template <typename T>
+static void run_chunk(const size_t* const in, T* const out,
+                      size_t const length, std::vector<size_t> following,
+                      const cv_kernel* const kernel, const size_t tile,
+                      cv_thread_times* const times = nullptr,
+                      const size_t* const three = nullptr) {
     if (0 == length) {
         return;
     }
     const size_t iterations = following.size();
+    const my_clock_t::time_point clock_setup = my_clock_t::now();
 
     /*
      * === Set up invariants for the loop. ===
@@ -111,9 +1249,11 @@ static void run_chunk(size_t* const begin, size_t const length,
      */
     for (size_t e = 1; e < iterations; ++e) {
         /* Beginning is e-established and needs to be
-         * at least (e+1)-established. We need to walk from back to front! */
-        for (size_t i = e; i != 0; --i) {
-            compute_cv(begin + i - 1, begin + i);
+         * at least (e+1)-established. We need to walk from back to front!
+         * The first step is the first round for position e-1. */
+        out[e - 1] = static_cast<T>(cv_step(in[e - 1], in[e]));
+        for (size_t i = e - 1; i != 0; --i) {
+            out[i - 1] = static_cast<T>(cv_step(out[i - 1], out[i]));
         }
     }
 
@@ -132,28 +1272,59 @@ static void run_chunk(size_t* const begin, size_t const length,
      * this way is at begin[length-e+1].
      */
     const size_t completable_end = length - iterations;
+    const my_clock_t::time_point clock_main = my_clock_t::now();
+    /* With 'three', the reducer follows right behind, one block at a time.
+     * Otherwise, everything is one block. */
+    unsigned char* const bytes = reinterpret_cast<unsigned char*>(out);
+    cv_reducer reducer(bytes, length, three, kernel);
+    size_t narrowed = 0;
+    const size_t block = three ? std::max(tile, reduce_block)
+                               : std::max<size_t>(completable_end, 1);
+    for (size_t b = 0; b < completable_end; b += block) {
+        const size_t b_end = std::min(completable_end, b + block);
 #ifndef CV_NO_SPECIALIZE
-    /* I'm not sure whether gcc can see that the if has always the same result
-     * during a call to run_chunk, so better play it safe. */
-    if (4 == iterations) {
-        for (size_t p = 0; p < completable_end; ++p) {
-            /* I'm not sure whether the explicit loop can be unrolled by gcc,
-             * so let's to it this way. */
-            compute_cv(begin + (p + 3), begin + (p + 4));
-            compute_cv(begin + (p + 2), begin + (p + 3));
-            compute_cv(begin + (p + 1), begin + (p + 2));
-            compute_cv(begin + (p + 0), begin + (p + 1));
-        }
-    } else {
+        /* 1 to 6 rounds take the specializations, anything else (and
+         * CV_NO_SPECIALIZE) the generic loops below. */
+        if (run_main_specialized(in, out, b, b_end, kernel, tile,
+                                 iterations)) {
+        } else
 #endif
-        for (size_t p = 0; p < completable_end; ++p) {
-            for (size_t i = iterations; i != 0; --i) {
-                compute_cv(begin + (p + (i - 1)), begin + (p + i));
+        if (tile > 1) {
+            /* Skewed wavefront: Same invariant, but advance by a whole
+             * tile instead of a single position. First make
+             * [q+iterations-1, q+iterations-1+width) 1-established, then
+             * [q+iterations-2, ...) 2-established, and so on.
+             * Each of these is a forward walk over independent pairs, so
+             * the positions of a tile fill the SIMD lanes and the
+             * out-of-order core, instead of waiting for the previous
+             * compute_cv like the loop below. And the tile is still in L1
+             * when the next walk starts, so this reads each cache line
+             * from RAM only once, just like below.
+             * With 'width == 1', this is exactly the loop below. */
+            for (size_t q = b; q < b_end; q += tile) {
+                const size_t width = std::min(tile, b_end - q);
+                const size_t first = q + (iterations - 1);
+                kernel_first(kernel, out + first, in + first, width);
+                for (size_t i = iterations - 1; i != 0; --i) {
+                    kernel_next(kernel, out + (q + (i - 1)), width);
+                }
+            }
+        } else {
+            for (size_t p = b; p < b_end; ++p) {
+                const size_t first = p + (iterations - 1);
+                out[first] = static_cast<T>(cv_step(in[first], in[first + 1]));
+                for (size_t i = iterations - 1; i != 0; --i) {
+                    out[p + (i - 1)] = static_cast<T>(
+                            cv_step(out[p + (i - 1)], out[p + i]));
+                }
             }
         }
-#ifndef CV_NO_SPECIALIZE
+        if (three) {
+            narrow_in_place(kernel, bytes, out, narrowed, b_end);
+            narrowed = b_end;
+            reducer.advance(b_end);
+        }
     }
-#endif
 
     /*
      * === Finishing up ===
@@ -176,22 +1347,99 @@ static void run_chunk(size_t* const begin, size_t const length,
      *
      * Note that we have to work backwards, and make the *last* position
      * 2-established first.
+     * The last position still has its original color during the first
+     * iteration, and only then.
      */
+    const my_clock_t::time_point clock_finish = my_clock_t::now();
     /* "plus one" because "completable_end == 0" is possible. */
+    size_t last = in[length - 1];
     for (size_t p_plus_1 = length - 1 + 1; p_plus_1 >= completable_end + 1; --p_plus_1) {
         const size_t p = p_plus_1 - 1;
         assert(!following.empty());
         /* Sorry for the naming. */
         for (size_t p2 = p; p2 < length - 1; ++p2) {
-            compute_cv(begin + p2, begin + (p2 + 1));
+            out[p2] = static_cast<T>(cv_step(out[p2], out[p2 + 1]));
         }
-        compute_cv(begin + (length - 1), &following.front());
+        last = cv_step(last, following.front());
+        out[length - 1] = static_cast<T>(last);
         for (size_t i = 1; i < following.size(); ++i) {
             compute_cv(&following[i - 1], &following[i]);
         }
         following.erase(--following.end());
     }
     assert(following.empty());
+    if (three) {
+        narrow_in_place(kernel, bytes, out, narrowed, length);
+        reducer.advance(length);
+    }
+
+    if (times) {
+        times->ns_setup += duration_to_ns(clock_main - clock_setup);
+        times->ns_main += duration_to_ns(clock_finish - clock_main);
+        times->ns_finish += duration_to_ns(my_clock_t::now() - clock_finish);
+    }
+}
+
+/* The fused engine never materializes the original colors. Each worker
+ * generates them from a stream, one tile at a time, and only the final
+ * colors ever reach RAM (if at all: 'out' may be nullptr).
+ *
+ * Within a tile of 'width' positions, round r needs the colors of the
+ * following (rounds - r) positions, so each tile generates 'rounds' more
+ * colors than it completes. Instead of carrying a staircase across tiles
+ * like run_chunk, these few extra positions are simply recomputed by the
+ * next tile, which keeps the whole thing stateless except for the stream.
+ * The list is a ring, so the stream starts over at position 0 when it
+ * reaches 'length'. */
+static void run_chunk_fused(const cv_stream* const stream, const size_t seed,
+                            const size_t length, const size_t from,
+                            const size_t to, const size_t rounds,
+                            unsigned char* const out,
+                            const cv_kernel* const kernel, const size_t tile,
+                            cv_thread_times* const times) {
+    const my_clock_t::time_point clock_setup = my_clock_t::now();
+    std::vector<size_t> colors(tile + rounds);
+    std::vector<unsigned char> small(tile + rounds);
+    size_t state[2];
+    size_t stream_pos = from;
+    stream->seek(state, seed, stream_pos);
+    /* Generates the original colors of the next 'count' positions. */
+    auto generate = [&](size_t* into, size_t count) {
+        while (count) {
+            if (length == stream_pos) {
+                stream_pos = 0;
+                stream->seek(state, seed, stream_pos);
+            }
+            const size_t now = std::min(count, length - stream_pos);
+            stream->generate(state, into, now);
+            into += now;
+            count -= now;
+            stream_pos += now;
+        }
+    };
+
+    /* colors[0..rounds) always holds the original colors of [p, p+rounds). */
+    generate(colors.data(), rounds);
+    const my_clock_t::time_point clock_main = my_clock_t::now();
+    for (size_t p = from; p < to; p += tile) {
+        const size_t width = std::min(tile, to - p);
+        generate(colors.data() + rounds, width);
+        kernel->round_narrow(small.data(), colors.data(), width + rounds - 1);
+        for (size_t r = 2; r <= rounds; ++r) {
+            kernel->round_byte(small.data(), width + rounds - r);
+        }
+        if (out) {
+            memcpy(out + (p - from), small.data(), width);
+        }
+        std::copy(colors.begin() + width, colors.begin() + (width + rounds),
+                  colors.begin());
+    }
+
+    /* There's nothing to finish: the tiles overlap instead. */
+    if (times) {
+        times->ns_setup += duration_to_ns(clock_main - clock_setup);
+        times->ns_main += duration_to_ns(my_clock_t::now() - clock_main);
+    }
 }
 
 
@@ -224,24 +1472,78 @@ static void fill_rnd_minstd(size_t* const begin, const size_t length,
 }
 
 static size_t xorshift128plus_seed[2];
-size_t xorshift128plus(void) {
+static inline size_t xorshift128plus_next(size_t* const state) {
     /* Taken from Wikipedia's article on fast PRNGs:
      * https://en.wikipedia.org/wiki/Xorshift#Xorshift.2B
      * Paper: http://vigna.di.unimi.it/ftp/papers/xorshiftplus.pdf */
-    size_t x = xorshift128plus_seed[0];
-    size_t const y = xorshift128plus_seed[1];
-    xorshift128plus_seed[0] = y;
+    size_t x = state[0];
+    size_t const y = state[1];
+    state[0] = y;
     x ^= x << 23; // a
     x ^= x >> 17; // b
     x ^= y ^ (y >> 26); // c
-    xorshift128plus_seed[1] = x;
+    state[1] = x;
     return x + y;
 }
 
+size_t xorshift128plus(void) {
+    return xorshift128plus_next(xorshift128plus_seed);
+}
+
+static void xorshift128plus_init(size_t* const state, size_t const seed) {
+    state[0] = seed;
+    state[1] = 0x8000000080004021UL;
+}
+
+/* The state transition of xorshift128+ (i.e., without the final addition) is
+ * linear over GF(2)^128, so skipping ahead n steps means multiplying the
+ * state with the n-th power of its 128x128 bit matrix. A matrix is stored
+ * as its 128 columns, where column j is the image of the j-th unit vector. */
+class gf2_matrix {
+public:
+    size_t col[128][2];
+};
+
+static void gf2_apply(const gf2_matrix& m, const size_t* const v,
+                      size_t* const into) {
+    size_t r[2] = {0, 0};
+    for (size_t j = 0; j < 128; ++j) {
+        if (1 & (v[j / 64] >> (j % 64))) {
+            r[0] ^= m.col[j][0];
+            r[1] ^= m.col[j][1];
+        }
+    }
+    into[0] = r[0];
+    into[1] = r[1];
+}
+
+static void xorshift128plus_jump(size_t* const state, size_t steps) {
+    static_assert(sizeof(size_t) == 8, "xorshift128plus needs 64-bit words");
+    gf2_matrix power;
+    for (size_t j = 0; j < 128; ++j) {
+        power.col[j][0] = 0;
+        power.col[j][1] = 0;
+        power.col[j][j / 64] = size_t(1) << (j % 64);
+        xorshift128plus_next(power.col[j]);
+    }
+    gf2_matrix squared;
+    while (steps) {
+        if (steps & 1) {
+            gf2_apply(power, state, state);
+        }
+        steps >>= 1;
+        if (steps) {
+            for (size_t j = 0; j < 128; ++j) {
+                gf2_apply(power, power.col[j], squared.col[j]);
+            }
+            power = squared;
+        }
+    }
+}
+
 static void fill_rnd_xorshift128plus(size_t* const begin, size_t const length,
                                      size_t const seed) {
-    xorshift128plus_seed[0] = seed;
-    xorshift128plus_seed[1] = 0x8000000080004021UL;
+    xorshift128plus_init(xorshift128plus_seed, seed);
 
     begin[0] = xorshift128plus();
     for (size_t i = 1; i < length; ++i) {
@@ -264,6 +1566,71 @@ static void fill_rnd_xorshift128plus(size_t* const begin, size_t const length,
 #endif
 }
 
+/* A stream generates the same colors as the corresponding fill, as long as
+ * the latter doesn't run into collisions (see cv_fill_parallel), but can
+ * start at any position. 'state' is at most two words. */
+static void seek_xorshift128plus(size_t* const state, size_t const seed,
+                                 size_t const position) {
+    xorshift128plus_init(state, seed);
+    xorshift128plus_jump(state, position);
+}
+
+static void generate_xorshift128plus(size_t* const state, size_t* const into,
+                                     size_t const count) {
+    for (size_t i = 0; i < count; ++i) {
+        into[i] = xorshift128plus_next(state);
+    }
+}
+
+static const cv_stream stream_xorshift128plus = {
+    "xorshift128plus", seek_xorshift128plus, generate_xorshift128plus, true
+};
+
+/* The minstd stream can't skip: std::uniform_int_distribution needs
+ * a varying number of draws from std::minstd_rand for a single 64-bit
+ * color, so there's no way to know where position i starts without
+ * generating everything before it.
+ * The state of std::minstd_rand is just its last output, so record that,
+ * and continue from there on the next call. */
+class recording_minstd {
+public:
+    typedef std::minstd_rand::result_type result_type;
+    static constexpr result_type min() {
+        return std::minstd_rand::min();
+    }
+    static constexpr result_type max() {
+        return std::minstd_rand::max();
+    }
+    result_type operator()() {
+        return last = generator();
+    }
+    std::minstd_rand generator;
+    result_type last;
+};
+
+static void seek_minstd(size_t* const state, size_t const seed,
+                        size_t const position) {
+    assert(0 == position);
+    (void)position;
+    state[0] = seed;
+}
+
+static void generate_minstd(size_t* const state, size_t* const into,
+                            size_t const count) {
+    recording_minstd rec;
+    rec.generator.seed(state[0]);
+    rec.last = state[0];
+    std::uniform_int_distribution<size_t> distrib;
+    for (size_t i = 0; i < count; ++i) {
+        into[i] = distrib(rec);
+    }
+    state[0] = rec.last;
+}
+
+static const cv_stream stream_minstd = {
+    "minstd", seek_minstd, generate_minstd, false
+};
+
 /*
 void fill_rnd_whatever(size_t* begin, size_t length, size_t seed) {
     // FIXME
@@ -273,27 +1640,707 @@ void fill_rnd_whatever(size_t* begin, size_t length, size_t seed) {
 */
 
 cv_fill_fn_t cv_default_fill = fill_rnd_minstd;
+const cv_stream* cv_default_stream = &stream_minstd;
 
-/* ===== Commandline parsing ===== */
+/* ===== CPU topology ===== */
 
-const std::string cv_about = ""
-"CV, a Cole-Vishkin emulator in C++11.\n"
-#ifndef NDEBUG
-"Compiled without NDEBUG (so this is the slow version).\n"
-#else
+#ifdef CV_HAVE_AFFINITY
+/* Returns -1 if there's no such file, e.g. for offline CPUs. */
+static long read_topology(const int cpu, const char* const what) {
+    char path[128];
+    snprintf(path, sizeof(path),
+             "/sys/devices/system/cpu/cpu%d/topology/%s", cpu, what);
+    FILE* fp = fopen(path, "r");
+    if (!fp) {
+        return -1;
+    }
+    long val = -1;
+    if (1 != fscanf(fp, "%ld", &val)) {
+        val = -1;
+    }
+    fclose(fp);
+    return val;
+}
+
+class cv_place {
+public:
+    int cpu;
+    long package;
+    long core;
+    /* Which SMT sibling of its core this is, and which core of its
+     * package, both counting from 0. */
+    size_t sibling;
+    size_t core_rank;
+};
+
+/* Parses lists like "0,2,4-7". */
+static const char* parse_cpu_list(const std::string& list,
+                                  std::vector<int>& into) {
+    const char* str = list.c_str();
+    while (*str) {
+        char* end = nullptr;
+        const long first = strtol(str, &end, 10);
+        long last = first;
+        if (end == str || first < 0) {
+            return "Bad CPU list for --pin.";
+        }
+        str = end;
+        if ('-' == *str) {
+            last = strtol(str + 1, &end, 10);
+            if (end == str + 1 || last < first) {
+                return "Bad CPU range for --pin.";
+            }
+            str = end;
+        }
+        if (last >= CPU_SETSIZE) {
+            return "CPU number too large for --pin.";
+        }
+        for (long cpu = first; cpu <= last; ++cpu) {
+            into.push_back(static_cast<int>(cpu));
+        }
+        if (',' == *str) {
+            ++str;
+        } else if (*str) {
+            return "Bad CPU list for --pin.";
+        }
+    }
+    return nullptr;
+}
+#endif
+
+/* Puts the CPUs in the order in which workers should be pinned to them,
+ * according to 'how' (see --pin). Leaves 'into' empty for "none".
+ * Returns a human-readable string on error, nullptr otherwise. */
+const char* cv_pin_order(const std::string& how, std::vector<int>& into) {
+    into.clear();
+    if ("none" == how) {
+        return nullptr;
+    }
+#ifndef CV_HAVE_AFFINITY
+    return "Sorry, --pin is only supported on Linux.";
+#else
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed)) {
+        return "sched_getaffinity failed.";
+    }
+
+    if (!how.empty() && how[0] >= '0' && how[0] <= '9') {
+        const char* err = parse_cpu_list(how, into);
+        if (err) {
+            return err;
+        }
+        for (const int cpu : into) {
+            if (!CPU_ISSET(cpu, &allowed)) {
+                printf("At CPU %d\n", cpu);
+                return "This process may not run on that CPU.";
+            }
+        }
+        return nullptr;
+    }
+    if ("compact" != how && "scatter" != how && "physical" != how) {
+        return "Only 'none', 'compact', 'scatter', 'physical', or a list of"
+                " CPUs are supported as --pin, sorry.";
+    }
+
+    std::vector<cv_place> places;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            /* Without topology information, each CPU is its own core. */
+            const long package = read_topology(cpu, "physical_package_id");
+            const long core = read_topology(cpu, "core_id");
+            places.push_back(cv_place{cpu, package, core < 0 ? cpu : core,
+                                      0, 0});
+        }
+    }
+    std::sort(places.begin(), places.end(),
+            [](const cv_place& a, const cv_place& b) {
+        if (a.package != b.package) {
+            return a.package < b.package;
+        }
+        if (a.core != b.core) {
+            return a.core < b.core;
+        }
+        return a.cpu < b.cpu;
+    });
+    for (size_t i = 1; i < places.size(); ++i) {
+        cv_place& prev = places[i - 1];
+        cv_place& cur = places[i];
+        if (cur.package != prev.package) {
+            continue;
+        }
+        if (cur.core == prev.core) {
+            cur.sibling = prev.sibling + 1;
+            cur.core_rank = prev.core_rank;
+        } else {
+            cur.core_rank = prev.core_rank + 1;
+        }
+    }
+
+    if ("scatter" == how) {
+        std::stable_sort(places.begin(), places.end(),
+                [](const cv_place& a, const cv_place& b) {
+            if (a.sibling != b.sibling) {
+                return a.sibling < b.sibling;
+            }
+            return a.core_rank < b.core_rank;
+        });
+    }
+    for (const cv_place& place : places) {
+        if ("physical" != how || 0 == place.sibling) {
+            into.push_back(place.cpu);
+        }
+    }
+    return nullptr;
+#endif
+}
+
+/* Empty if there's no /proc/cpuinfo, or no model name in it. */
+static std::string cv_cpu_model() {
+    FILE* fp = fopen("/proc/cpuinfo", "r");
+    if (!fp) {
+        return std::string();
+    }
+    std::string model;
+    char line[512];
+    while (fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, "model name", 10)) {
+            continue;
+        }
+        const char* value = strchr(line, ':');
+        if (value) {
+            model = value + 1 + strspn(value + 1, " \t");
+            model.erase(model.find_last_not_of(" \n") + 1);
+        }
+        break;
+    }
+    fclose(fp);
+    return model;
+}
+
+
+/* ===== Performance counters ===== */
+
+const char* const cv_perf_names[] = {
+    "cycles", "instructions", "llc_misses", "dtlb_misses", "stalled_cycles"
+};
+
+#ifdef CV_HAVE_PERF
+static int open_perf_event(const long tid, const uint32_t type,
+                           const uint64_t config) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+            | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    /* With perf_event_paranoid at 2 (the usual default), that's all we
+     * may count anyway. */
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, tid, -1, -1,
+                                    PERF_FLAG_FD_CLOEXEC));
+}
+#endif
+
+cv_perf::~cv_perf() {
+    for (const int fd : fds) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+}
+
+const char* cv_perf::open(const std::vector<long>& tids) {
+#ifdef CV_HAVE_PERF
+    static const uint64_t miss = (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    static const uint32_t types[cv_perf_events] = {
+        PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+        PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE
+    };
+    static const uint64_t configs[cv_perf_events] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_LL | miss, PERF_COUNT_HW_CACHE_DTLB | miss,
+        PERF_COUNT_HW_STALLED_CYCLES_BACKEND
+    };
+    threads = tids.size();
+    fds.assign(threads * cv_perf_events, -1);
+    bool any = false;
+    for (size_t e = 0; e < cv_perf_events; ++e) {
+        /* If one thread can't have it, none gets it. */
+        available[e] = true;
+        for (size_t t = 0; t < threads && available[e]; ++t) {
+            int& fd = fds[t * cv_perf_events + e];
+            fd = open_perf_event(tids[t], types[e], configs[e]);
+            available[e] = fd >= 0;
+        }
+        for (size_t t = 0; t < threads && !available[e]; ++t) {
+            int& fd = fds[t * cv_perf_events + e];
+            if (fd >= 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        any = any || available[e];
+    }
+    if (!any) {
+        return "Can't count any hardware events. (Is there a PMU? What does"
+               " /proc/sys/kernel/perf_event_paranoid say?)";
+    }
+    return nullptr;
+#else
+    (void)tids;
+    return "Performance counters are only supported on Linux.";
+#endif
+}
+
+/* The raw counts, which only add_counts() scales. */
+void cv_perf::read(std::vector<cv_counts>& into) const {
+    into.assign(threads, cv_counts());
+    for (size_t t = 0; t < threads; ++t) {
+        for (size_t e = 0; e < cv_perf_events; ++e) {
+            const int fd = fds[t * cv_perf_events + e];
+            uint64_t buf[3];
+            if (fd < 0 || static_cast<ssize_t>(sizeof(buf))
+                    != ::read(fd, buf, sizeof(buf))) {
+                continue;
+            }
+            into[t].value[e] = buf[0];
+            into[t].enabled[e] = buf[1];
+            into[t].running[e] = buf[2];
+        }
+    }
+}
+
+static long current_tid() {
+#ifdef CV_HAVE_PERF
+    return syscall(SYS_gettid);
+#else
+    return -1;
+#endif
+}
+
+/* 'into' += 'to' - 'from', for each event. If the events had to share the
+ * hardware in between, that's scaled up to the whole time, like perf does.
+ * Scaling only the difference keeps it from going negative. */
+static void add_counts(cv_counts& into, const cv_counts& from,
+                       const cv_counts& to) {
+    for (size_t e = 0; e < cv_perf_events; ++e) {
+        const uint64_t value = to.value[e] - from.value[e];
+        const uint64_t enabled = to.enabled[e] - from.enabled[e];
+        const uint64_t running = to.running[e] - from.running[e];
+        into.value[e] += running && running < enabled
+                ? static_cast<uint64_t>(static_cast<double>(value)
+                                        * enabled / running)
+                : value;
+    }
+}
+
+
+/* ===== Memory ===== */
+
+const char* const cv_alloc_names[] = {"plain", "thp", "hugetlb", "hugetlb1g"};
+
+#ifdef CV_HAVE_HUGE_PAGES
+static size_t page_size(const cv_alloc how) {
+    switch (how) {
+    case cv_alloc::hugetlb1g:
+        return 1UL << 30;
+    case cv_alloc::thp:
+    case cv_alloc::hugetlb:
+        return 1UL << 21;
+    case cv_alloc::plain:
+        break;
+    }
+    return 1UL << 12;
+}
+#endif
+
+/* Returns nullptr on failure. Must be freed by cv_deallocate, with the
+ * same 'bytes' and 'how'. */
+void* cv_allocate(const size_t bytes, const cv_alloc how) {
+#ifdef CV_HAVE_HUGE_PAGES
+    const size_t page = page_size(how);
+    const size_t rounded = (bytes + page - 1) & ~(page - 1);
+    if (cv_alloc::thp == how) {
+        /* THP only kicks in for aligned 2 MiB ranges, so the last one must
+         * be all ours, too. */
+        void* data = nullptr;
+        if (posix_memalign(&data, page, rounded)) {
+            return nullptr;
+        }
+        /* Not fatal: the kernel may have THP disabled entirely. */
+        madvise(data, rounded, MADV_HUGEPAGE);
+        return data;
+    }
+    if (cv_alloc::hugetlb == how || cv_alloc::hugetlb1g == how) {
+        /* Ask for the size explicitly, since cv_deallocate relies on it,
+         * and the default huge page size might be another one. */
+        int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB;
+        if (cv_alloc::hugetlb1g == how) {
+            flags |= 30 << MAP_HUGE_SHIFT;
+        } else {
+            flags |= 21 << MAP_HUGE_SHIFT;
+        }
+        void* data = mmap(nullptr, rounded, PROT_READ | PROT_WRITE, flags,
+                          -1, 0);
+        return MAP_FAILED == data ? nullptr : data;
+    }
+#endif
+    assert(cv_alloc::plain == how);
+    /* Page-aligned, so that --write direct can do most of its work. */
+    void* data = nullptr;
+    return posix_memalign(&data, 4096, bytes) ? nullptr : data;
+}
+
+void cv_deallocate(void* const data, const size_t bytes, const cv_alloc how) {
+    if (!data) {
+        return;
+    }
+#ifdef CV_HAVE_HUGE_PAGES
+    if (cv_alloc::hugetlb == how || cv_alloc::hugetlb1g == how) {
+        const size_t page = page_size(how);
+        munmap(data, (bytes + page - 1) & ~(page - 1));
+        return;
+    }
+#else
+    (void)how;
+#endif
+    (void)bytes;
+    free(data);
+}
+
+
+/* ===== Output encodings ===== */
+
+/* After enough rounds, all colors are in 0..5, which wastes most of a byte:
+ * - packed3: 3 bits per node, so 8 nodes make 3 bytes. Fine for 0..7.
+ * - base6: 3 nodes per byte, as a + 6*b + 36*c. Only for 0..5.
+ * Both pack the nodes in order, and the last group may be incomplete. */
+
+const char* const cv_encoding_names[] = {"byte", "packed3", "base6"};
+
+/* "CVPK", format version, encoding, rounds, length, seed, all of them
+ * little-endian. The rest is zero. */
+static const uint32_t header_magic = 0x4b505643;
+static const uint32_t header_version = 1;
+
+static void put_le(unsigned char* const into, uint64_t val, const size_t bytes) {
+    for (size_t i = 0; i < bytes; ++i, val >>= 8) {
+        into[i] = static_cast<unsigned char>(val);
+    }
+}
+
+static uint64_t get_le(const unsigned char* const from, const size_t bytes) {
+    uint64_t val = 0;
+    for (size_t i = bytes; i > 0; --i) {
+        val = (val << 8) | from[i - 1];
+    }
+    return val;
+}
+
+void cv_encode_header(unsigned char* const into, const cv_encoding encoding,
+                      const size_t length, const size_t rounds,
+                      const size_t seed) {
+    memset(into, 0, cv_header_size);
+    put_le(into, header_magic, 4);
+    put_le(into + 4, header_version, 4);
+    put_le(into + 8, static_cast<uint32_t>(encoding), 4);
+    put_le(into + 12, rounds, 4);
+    put_le(into + 16, length, 8);
+    put_le(into + 24, seed, 8);
+}
+
+const char* cv_decode_header(const unsigned char* const from,
+                             cv_encoding& encoding, size_t& length,
+                             size_t& rounds, size_t& seed) {
+    if (get_le(from, 4) != header_magic) {
+        return "Not a packed CV file.";
+    }
+    if (get_le(from + 4, 4) != header_version) {
+        return "Unknown version of the packed CV format.";
+    }
+    const uint64_t enc = get_le(from + 8, 4);
+    if (enc != static_cast<uint32_t>(cv_encoding::packed3)
+            && enc != static_cast<uint32_t>(cv_encoding::base6)) {
+        return "Unknown encoding in the packed CV file.";
+    }
+    encoding = static_cast<cv_encoding>(enc);
+    rounds = get_le(from + 12, 4);
+    length = get_le(from + 16, 8);
+    seed = get_le(from + 24, 8);
+    return nullptr;
+}
+
+/* How many nodes make up a whole number of bytes. */
+size_t cv_group_nodes(const cv_encoding encoding) {
+    switch (encoding) {
+    case cv_encoding::packed3:
+        return 8;
+    case cv_encoding::base6:
+        return 3;
+    case cv_encoding::byte:
+        break;
+    }
+    return 1;
+}
+
+/* Without the header. */
+size_t cv_encoded_size(const size_t length, const cv_encoding encoding) {
+    switch (encoding) {
+    case cv_encoding::packed3:
+        return length / 8 * 3 + (length % 8 * 3 + 7) / 8;
+    case cv_encoding::base6:
+        return (length + 2) / 3;
+    case cv_encoding::byte:
+        break;
+    }
+    return length;
+}
+
+static void pack3_scalar(unsigned char* const out, const unsigned char* const in,
+                         const size_t count) {
+    for (size_t i = 0, o = 0; i < count; i += 8, o += 3) {
+        const size_t n = std::min<size_t>(8, count - i);
+        uint32_t bits = 0;
+        for (size_t j = 0; j < n; ++j) {
+            assert(in[i + j] < 8);
+            bits |= static_cast<uint32_t>(in[i + j]) << (3 * j);
+        }
+        put_le(out + o, bits, (n * 3 + 7) / 8);
+    }
+}
+
+static void unpack3_scalar(unsigned char* const out,
+                           const unsigned char* const in, const size_t count) {
+    for (size_t i = 0, o = 0; i < count; i += 8, o += 3) {
+        const size_t n = std::min<size_t>(8, count - i);
+        const uint64_t bits = get_le(in + o, (n * 3 + 7) / 8);
+        for (size_t j = 0; j < n; ++j) {
+            out[i + j] = (bits >> (3 * j)) & 7;
+        }
+    }
+}
+
+#ifdef CV_HAVE_X86_KERNELS
+/* pext gathers the low 3 bits of all 8 bytes at once, and pdep scatters
+ * them back. Little-endian, so the byte order is right. */
+static const uint64_t low3_of_each_byte = 0x0707070707070707ULL;
+
+__attribute__((target("bmi2")))
+static void pack3_bmi2(unsigned char* const out, const unsigned char* const in,
+                       const size_t count) {
+    size_t i = 0;
+    size_t o = 0;
+    for (; i + 8 <= count; i += 8, o += 3) {
+        uint64_t eight;
+        memcpy(&eight, in + i, sizeof(eight));
+        assert(!(eight & ~low3_of_each_byte));
+        const uint32_t bits = static_cast<uint32_t>(
+                _pext_u64(eight, low3_of_each_byte));
+        memcpy(out + o, &bits, 3);
+    }
+    pack3_scalar(out + o, in + i, count - i);
+}
+
+__attribute__((target("bmi2")))
+static void unpack3_bmi2(unsigned char* const out,
+                         const unsigned char* const in, const size_t count) {
+    size_t i = 0;
+    size_t o = 0;
+    for (; i + 8 <= count; i += 8, o += 3) {
+        uint32_t bits = 0;
+        memcpy(&bits, in + o, 3);
+        const uint64_t eight = _pdep_u64(bits, low3_of_each_byte);
+        memcpy(out + i, &eight, sizeof(eight));
+    }
+    unpack3_scalar(out + i, in + o, count - i);
+}
+#endif
+
+static void pack6(unsigned char* const out, const unsigned char* const in,
+                  const size_t count) {
+    size_t i = 0;
+    size_t o = 0;
+    for (; i + 3 <= count; i += 3, ++o) {
+        assert(in[i] < 6 && in[i + 1] < 6 && in[i + 2] < 6);
+        out[o] = static_cast<unsigned char>(in[i] + 6 * in[i + 1]
+                                            + 36 * in[i + 2]);
+    }
+    if (i < count) {
+        assert(in[i] < 6 && (i + 1 == count || in[i + 1] < 6));
+        out[o] = static_cast<unsigned char>(in[i]
+                + (i + 1 < count ? 6 * in[i + 1] : 0));
+    }
+}
+
+/* A table is a lot faster than dividing by 6, twice. */
+class base6_table {
+public:
+    base6_table() {
+        for (size_t v = 0; v < 216; ++v) {
+            digits[v][0] = v % 6;
+            digits[v][1] = v / 6 % 6;
+            digits[v][2] = v / 36;
+        }
+    }
+    unsigned char digits[216][3];
+};
+
+static void unpack6(unsigned char* const out, const unsigned char* const in,
+                    const size_t count) {
+    static const base6_table table;
+    size_t i = 0;
+    size_t o = 0;
+    for (; i + 3 <= count; i += 3, ++o) {
+        assert(in[o] < 216);
+        memcpy(out + i, table.digits[in[o]], 3);
+    }
+    for (size_t j = 0; i < count; ++i, ++j) {
+        out[i] = table.digits[in[o]][j];
+    }
+}
+
+/* 'count' nodes from 'in' to cv_encoded_size(count) bytes in 'out'.
+ * To pack a list piece by piece, all but the last piece must consist of
+ * whole groups. */
+void cv_pack(unsigned char* const out, const unsigned char* const in,
+             const size_t count, const cv_encoding encoding) {
+    switch (encoding) {
+    case cv_encoding::packed3:
+#ifdef CV_HAVE_X86_KERNELS
+        if (__builtin_cpu_supports("bmi2")) {
+            pack3_bmi2(out, in, count);
+            return;
+        }
+#endif
+        pack3_scalar(out, in, count);
+        return;
+    case cv_encoding::base6:
+        pack6(out, in, count);
+        return;
+    case cv_encoding::byte:
+        break;
+    }
+    memcpy(out, in, count);
+}
+
+void cv_unpack(unsigned char* const out, const unsigned char* const in,
+               const size_t count, const cv_encoding encoding) {
+    switch (encoding) {
+    case cv_encoding::packed3:
+#ifdef CV_HAVE_X86_KERNELS
+        if (__builtin_cpu_supports("bmi2")) {
+            unpack3_bmi2(out, in, count);
+            return;
+        }
+#endif
+        unpack3_scalar(out, in, count);
+        return;
+    case cv_encoding::base6:
+        unpack6(out, in, count);
+        return;
+    case cv_encoding::byte:
+        break;
+    }
+    memcpy(out, in, count);
+}
+
+
+/* ===== Commandline parsing ===== */
+
+const std::string cv_about = ""
+"CV, a Cole-Vishkin emulator in C++11.\n"
+#ifndef NDEBUG
+"Compiled without NDEBUG (so this is the slow version).\n"
+#else
 "Compiled with NDEBUG (so this is the fast version).\n"
 #endif
-"Default arguments: --cpus 4 --file-out cv_out.dat --format human \\\n"
-"    --init-pattern minstd --init-seed 0 --length 268435456 --rounds 4\n"
+"Default arguments: --alloc plain --cpus 4 --engine inplace \\\n"
+"    --file-out cv_out.dat \\\n"
+"    --format human --init-pattern minstd --init-seed 0 --kernel auto \\\n"
+"    --length 268435456 --memory-budget 16G --pin none --rounds 4 \\\n"
+"    --tile 512 --write async\n"
 "\n"
 "Explanation of each argument:\n"
+"--alloc <type>:\n"
+"    Where the memory for the colors comes from. There is:\n"
+"    plain: Good old malloc. Usually 4 KiB pages.\n"
+"    thp: Transparent huge pages, by asking the kernel nicely with\n"
+"        madvise(MADV_HUGEPAGE). Falls back to small pages silently.\n"
+"    hugetlb: 2 MiB pages from the hugetlb pool. Fails unless enough of\n"
+"        them are reserved in /proc/sys/vm/nr_hugepages.\n"
+"    hugetlb1g: Like hugetlb, but with 1 GiB pages.\n"
+"    Huge pages mean fewer page faults and fewer TLB misses. Unless it's\n"
+"    'plain', the human-readable statistics start with the type.\n"
+"--bench <trials>:\n"
+"    Instead of printing the statistics of each job, runs it --bench-warmup\n"
+"    times without looking, and then <trials> times for real. Prints the\n"
+"    median of the CV and <All> times, their median absolute deviation\n"
+"    (MAD), the 95% confidence interval of the median (estimated from the\n"
+"    MAD), and how many trials were outliers, i.e. more than 3 MADs (scaled\n"
+"    to a standard deviation) away from the median. With --format csv, json,\n"
+"    or tdl, that's one line per job instead. Combine with --jobs or --sweep\n"
+"    to benchmark more than one configuration.\n"
+"--bench-baseline <filename>:\n"
+"    Compares each job to the same configuration in this file, as written\n"
+"    by --bench-save. A job is 'slower' or 'faster' only if the confidence\n"
+"    intervals don't overlap, and 'same' otherwise. If any job's CV time is\n"
+"    'slower', the exit code is 4.\n"
+"--bench-save <filename>:\n"
+"    Writes the results of --bench to this file, for --bench-baseline.\n"
+"--bench-warmup <n>:\n"
+"    How many runs of each job --bench ignores first. Default is 1.\n"
 "--cpus <n>:\n"
 "    How many worker threads should run on the data. This shouldn't exceed\n"
 "    your physical resources too far.\n"
+"--engine <type>:\n"
+"    How the colors are stored while computing. There is:\n"
+"    inplace: The 64-bit colors are overwritten round by round. The colors\n"
+"        are narrowed to the one byte per node of the file only at the end.\n"
+"    narrow: The first round reads the 64-bit colors, and writes its result\n"
+"        to a separate byte array. All later rounds only touch that array,\n"
+"        which is then written to the file as-is. Needs one more byte\n"
+"        per node, but only reads the 64-bit colors once, and never writes\n"
+"        them.\n"
+"    fused: Never stores the original colors. Each worker generates them on\n"
+"        the fly, one tile at a time, and only keeps the final colors. Needs\n"
+"        one byte per node, or nothing at all with '--file-out /dev/null'.\n"
+"        Only works with an --init-pattern that can skip ahead. Note that\n"
+"        duplicates are not skipped, even without NDEBUG.\n"
+"    stream: Like narrow, but only for one window of the list at a time,\n"
+"        which is written to the file as soon as it's done. The window is\n"
+"        as large as --memory-budget allows. This is the only engine which\n"
+"        can handle lists that don't fit into memory. Note that duplicates\n"
+"        are not skipped, even without NDEBUG.\n"
+"    list: A real linked list: node i's successor is next[i], which comes\n"
+"        from --list-locality or --list-file. The colors are those of the\n"
+"        other engines, by node, and so is the file. Each round gathers the\n"
+"        successors' colors, with prefetching, into one of two byte arrays.\n"
+"        With '--list-locality 1', this computes exactly what the others do,\n"
+"        just slower. Needs 18 bytes per node. Note that duplicates are only\n"
+"        skipped along the array, not along the list.\n"
+"    forest: Like list, but node i's parent is parent[i], and roots are\n"
+"        their own parent. The parents come from --forest-depth and\n"
+"        --forest-fanout, or --forest-file, and are shuffled by\n"
+"        --list-locality. A root keeps bit 0 of its color, as in the\n"
+"        classic algorithm, so the result is still a proper coloring.\n"
 "--file-out <filename>:\n"
 "    The file to which the result should be written. A bit pointless,\n"
 "    since no-one reads it anyways. But without this, Cole-Vishkin would be\n"
 "    utterly pointless.\n"
+"--forest-depth <n>:\n"
+"    For '--engine forest', each tree has n+1 levels. 0 (the default) makes\n"
+"    one tree of all nodes.\n"
+"--forest-fanout <n>:\n"
+"    For '--engine forest', level l of a tree has n^l nodes, each of which\n"
+"    picks its parent at random from level l-1. So n is the average number\n"
+"    of children. 1 makes paths, with a root at the end. Default is 2.\n"
+"--forest-file <filename>:\n"
+"    Implies '--engine forest', and reads the parents from the file, like\n"
+"    --list-file. Roots are their own parent.\n"
 "--format <type>\n"
 "    How the gathered statistics should be output. There is:\n"
 "    none: Doesn't print anything unless there's an error.\n"
@@ -301,6 +2348,24 @@ const std::string cv_about = ""
 "    tdl: Tab-delimited line. Ideal for batch execution. The order is the same\n"
 "        as with human-readable: Init, CV, Cleanup, <ALL>. where <ALL> is more\n"
 "        accurate than summing up the previous three.\n"
+"        Then the details, in nanoseconds: alloc (only for the first job),\n"
+"        fill, borders, CV, pack, write, <ALL>. Then min, mean, and max over\n"
+"        the threads of their setup, main, finish, and narrow times, also in\n"
+"        nanoseconds. Then nodes per second, and GB per second, where each\n"
+"        node counts as 8 bytes, both for the CV phase. And last, the\n"
+"        columns of --perf-counters, if given. New columns only ever get\n"
+"        appended, so the first four stay where they are.\n"
+"    Both human and tdl show the details, which are:\n"
+"        alloc: Threads and memory. fill: The original colors. borders:\n"
+"        Copying the 'following' colors for each chunk. CV: All the rounds,\n"
+"        as in the first part. pack: For --output-encoding. write: All the\n"
+"        rest. For each thread: setup: The staircase at the beginning of\n"
+"        the chunk. main: The bulk of it. finish: The part that needs the\n"
+"        next chunk's colors. narrow: Narrowing and writing the chunk.\n"
+"    json: One object per line and job, with all the options, how cv was\n"
+"        built, the host, and all of the above. The keys are the same as the\n"
+"        columns of csv.\n"
+"    csv: Like json, but with a header line first, and one line per job.\n"
 "--help:\n"
 "    Prints this help text and quits.\n"
 "--init-pattern <type>:\n"
@@ -309,18 +2374,90 @@ const std::string cv_about = ""
 "    and 'xorshift128plus', which uses this:\n"
 "        https://en.wikipedia.org/wiki/Xorshift#Xorshift.2B\n"
 "    Note that, no matter the pattern used, duplicates will be skipped.\n"
+"    'xorshift128plus' is generated in parallel by --cpus threads, which\n"
+"    skip ahead to their part of the list. The result is the same as when\n"
+"    generated sequentially. 'minstd' can't skip ahead, and is always\n"
+"    generated by a single thread.\n"
 "    Note that future versions may introduce a --init-max argument.\n"
 "--init-seed <n>:\n"
 "    The seed for the pattern (presumably a PRNG). This argument exists in\n"
 "    order to provide reproducibility.\n"
+"--jobs <filename>:\n"
+"    Runs several jobs in a row, one per line of the file. Each line is\n"
+"    '<seed> <length> <rounds> <cpus>', which replaces the corresponding\n"
+"    options, so '--rounds auto' only applies where <rounds> is 'auto'.\n"
+"    Everything else comes from the command line. Empty lines and lines\n"
+"    starting with '#' are ignored. The threads and the memory are set up\n"
+"    only once, which is accounted to the first job. Prints the statistics\n"
+"    once per job.\n"
+"--kernel <type>:\n"
+"    Which implementation of a single round to use. 'auto' (the default)\n"
+"    picks the best one this CPU supports, in this order: 'avx512' (needs\n"
+"    AVX-512F and AVX-512CD), 'avx2', and 'scalar'.\n"
+"    All kernels compute exactly the same colors.\n"
 "--length <n>:\n"
 "    Length of the simulated list. Note that cv will need approximately this\n"
 "    many words of memory. For the default amount (roughly 200 million), this\n"
 "    equals 2 GiB on a 64-bit machine, or 1 GiB on a 32-bit one.\n"
+"    See --engine for ways to use less, and --memory-budget for the limit.\n"
 "--length-force\n"
 "    Accept the length without issueing a warning.\n"
 "    DO THIS ONLY WHEN YOU KNOW WHICH WARNING YOU ARE IGNORING!\n"
 "    (Otherwise it will eat all your RAM.)\n"
+"--list-file <filename>:\n"
+"    Implies '--engine list', and reads the successors from the file: one\n"
+"    64-bit number in host byte order per node, so this also decides the\n"
+"    --length. No node may be its own successor.\n"
+"--list-locality <n>:\n"
+"    For '--engine list', the nodes of the ring are shuffled within windows\n"
+"    of n nodes each, and likewise those of the trees for forest. 1 keeps\n"
+"    them in order, 0 (the default) shuffles the whole list, which means a\n"
+"    cache miss per node. The shuffle depends on the --init-seed.\n"
+"--memory-budget <bytes>:\n"
+"    Upper limit for the memory used for colors. Accepts the suffixes K, M,\n"
+"    G, and T. Runs that would need more are rejected, except for\n"
+"    '--engine stream', which uses it to choose its window size.\n"
+"    Default is 16G.\n"
+"--output-encoding <type>:\n"
+"    How the colors are stored in the file. There is:\n"
+"    byte: One byte per node, nothing else. This is the default.\n"
+"    packed3: 3 bits per node, so 8 nodes make 3 bytes. Needs --rounds 3\n"
+"        or more.\n"
+"    base6: 3 nodes per byte, as a + 6*b + 36*c. Needs --rounds 4 or more.\n"
+"    The packed encodings start with a 32-byte header: 'CVPK', the format\n"
+"    version (1), the encoding (1 or 2), and the rounds as 32-bit numbers,\n"
+"    then the length and the seed as 64-bit numbers, all little-endian.\n"
+"    The rest of the header is zero.\n"
+"--pin <how>:\n"
+"    Which CPUs the worker threads run on. Without pinning, the kernel is\n"
+"    free to move them around, e.g. onto the same core or to another\n"
+"    socket, far away from their part of the list. There is:\n"
+"    none: Don't pin. This is the default.\n"
+"    compact: Fill up each core (all its SMT siblings), then each socket,\n"
+"        before using the next one.\n"
+"    scatter: Spread out as far as possible: round-robin over the sockets,\n"
+"        and use every core before any second SMT sibling.\n"
+"    physical: Like compact, but only one thread per core.\n"
+"    <list>: Exactly these CPUs, like '0,2,4-7'. Worker i gets the i-th.\n"
+"    If there are more workers than CPUs, it starts over. The topology is\n"
+"    read from /sys, and only CPUs that this process may use are used.\n"
+"    When pinning, each worker first touches its own part of the memory.\n"
+"--perf-counters:\n"
+"    Count cycles, instructions, LLC misses, dTLB misses, and stalled cycles\n"
+"    of all threads (except the background writer), for the fill, the CV\n"
+"    phase, and the cleanup. The statistics then show IPC, bytes per cycle\n"
+"    (with 8 bytes per node), misses per node, and which share of the cycles\n"
+"    were stalled, and for human-readable also the IPC of each worker.\n"
+"    Whatever the kernel doesn't allow is 'n/a', or 'nan' for tdl. This\n"
+"    needs a hardware PMU, and perf_event_paranoid of at most 2.\n"
+"--prefault:\n"
+"    Let the workers touch all memory before the run starts, so the page\n"
+"    faults aren't part of Init. This is always done for --jobs and --pin.\n"
+"    Each page is touched by the thread that will work on it. But jobs\n"
+"    reuse the buffers when they can, so with several jobs, that's the\n"
+"    thread of the job which allocated the buffer, which may have had a\n"
+"    different --cpus. The human-readable statistics then start with the\n"
+"    time it took.\n"
 "--rounds <n>:\n"
 "    The number of rounds for which Cole-Vishkin should be executed.\n"
 "    Here's a table about how long the initial color may be for each value:\n"
@@ -330,6 +2467,48 @@ const std::string cv_about = ""
 "    4: 128 bits or less\n"
 "    5: 2^64 bits or less\n"
 "    6: YAGNI\n"
+"    Or 'auto', which takes exactly as many as the widest initial color\n"
+"    needs according to this table. Finding that out is part of the fill,\n"
+"    so it's free. The fused and stream engines never see all colors at\n"
+"    once, and always take as many as 64 bits need.\n"
+"--sweep <option>=<value>,<value>,...:\n"
+"    Runs each job once per value, as if '--<option> <value>' was given.\n"
+"    Works with every option that takes a value, except those that apply\n"
+"    to the whole run: --pin, --jobs, --format, and the --bench ones. If\n"
+"    there are several, all combinations are run, with the first --sweep\n"
+"    changing the slowest. For example, '--sweep cpus=1,2,4\n"
+"    --sweep init-pattern=minstd,xorshift128plus' runs 6 jobs. Each job\n"
+"    gets its buffers the way it asks for them. Goes well with --bench.\n"
+"--three-colors:\n"
+"    After the rounds, reduce the 6 colors to 3, in the classic way: the\n"
+"    nodes of color 5, then 4, then 3 each take the smallest of 0, 1, and 2\n"
+"    which neither neighbor has. All three passes go in a single sweep\n"
+"    right behind the rounds, over the bytes of the colors ('inplace'\n"
+"    narrows them first, as it would anyway). So it costs no extra memory\n"
+"    traffic, only a little computation. Needs at least 4 rounds, and\n"
+"    '--engine inplace' or 'narrow'.\n"
+"--tile <n>:\n"
+"    How many positions each worker advances at once. Within a tile, all\n"
+"    positions are independent, so they can be computed side by side\n"
+"    (e.g., by the SIMD kernels). 'tile' words should comfortably fit into\n"
+"    the L1 cache. A tile of 1 means the classic position-by-position\n"
+"    pipeline, which always uses the scalar code. Default is 512.\n"
+"--write <how>:\n"
+"    How the output file is written. There is:\n"
+"    sync: Everything at once with fwrite, after all work is done.\n"
+"    async: Each chunk is handed to a writer thread as soon as its worker\n"
+"        is done, so writing overlaps with the rest of the work. The\n"
+"        streaming engine keeps two windows, so one can be written while\n"
+"        the next one is computed. This is the default.\n"
+"    direct: Like async, but with O_DIRECT where the alignment allows it,\n"
+"        which avoids copying everything into the page cache.\n"
+"    mmap: The file is truncated to its final size and mapped into memory.\n"
+"        The workers put their colors right into it, and the kernel writes\n"
+"        them back whenever it likes. There's no copy and nothing left to\n"
+"        do at the end. The narrow and fused engines even do all their\n"
+"        rounds in there. For anything but regular files, like /dev/null,\n"
+"        'async' is used instead.\n"
+"    For pipes and such, 'sync' is used anyway.\n"
 "\n"
 "Go forth and haveth fun!"; // No trailing newline!
 
@@ -339,7 +2518,15 @@ const std::string cv_output_format_human = ""
 "Cole-Vishkin took %ld ms.\n"
 "Cleanup took %ld ms.\n"
 "<All> took %ld ms.\n";
-const std::string cv_output_format_tdl = "%ld\t%ld\t%ld\t%ld\n";
+/* cv_print_times adds the details, and the newline. */
+const std::string cv_output_format_tdl = "%ld\t%ld\t%ld\t%ld";
+/* These two aren't printf formats, cv_print_times does it all. */
+const std::string cv_output_format_json = "json";
+const std::string cv_output_format_csv = "csv";
+const char* const cv_engine_names[] = {
+    "inplace", "narrow", "fused", "stream", "list", "forest"
+};
+const char* const cv_write_names[] = {"sync", "async", "direct", "mmap"};
 
 static const char* advance(int& i, const int argc) {
     ++i;
@@ -353,27 +2540,178 @@ static const char* try_stos(const char* str, size_t& into) {
     try {
         into = std::stoll(str);
         return nullptr;
-    } catch (std::invalid_argument) {
+    } catch (const std::invalid_argument&) {
+        return "Need a numeric argument.";
+    } catch (const std::out_of_range&) {
+        return "Expected numeric argument.";
+    }
+}
+
+static bool discards_output(const std::string& file_out_name) {
+    return "/dev/null" == file_out_name;
+}
+
+/* Like try_stos, but accepts a suffix K, M, G, or T (powers of 1024). */
+static const char* try_stob(const char* str, unsigned long long& into) {
+    try {
+        size_t idx = 0;
+        into = std::stoull(str, &idx);
+        const std::string suffix = str + idx;
+        const std::string units = "KMGT";
+        if (suffix.empty()) {
+            return nullptr;
+        }
+        const size_t unit = units.find(suffix);
+        if (suffix.size() != 1 || std::string::npos == unit) {
+            return "Expected a number of bytes, optionally with K, M, G, or T.";
+        }
+        into <<= 10 * (unit + 1);
+        return nullptr;
+    } catch (const std::invalid_argument&) {
         return "Need a numeric argument.";
-    } catch (std::out_of_range) {
+    } catch (const std::out_of_range&) {
         return "Expected numeric argument.";
     }
 }
 
+/* Memory needed for the colors, in bytes. */
+/* The streaming engine needs the original colors plus the narrowed ones
+ * (twice, when writing in the background), and the same again if they get
+ * packed. Packed colors need less than a byte, but let's not be stingy. */
+static size_t stream_bytes_per_node(const cv_opts& opts) {
+    const size_t copies = cv_write::sync == opts.write ? 1 : 2;
+    const size_t packed = cv_encoding::byte == opts.encoding ? 0 : 1;
+    return sizeof(size_t) + copies * (1 + packed);
+}
+
+unsigned long long cv_memory_needed(const cv_opts& opts) {
+    const unsigned long long nodes = opts.length;
+    const unsigned long long packed = cv_encoding::byte == opts.encoding
+            ? 0 : cv_encoded_size(opts.length, opts.encoding);
+    switch (opts.engine) {
+    case cv_engine::inplace:
+        return nodes * sizeof(size_t) + packed;
+    case cv_engine::narrow:
+        return nodes * (sizeof(size_t) + 1) + packed;
+    case cv_engine::fused:
+        return discards_output(opts.file_out_name) ? 0 : nodes + packed;
+    case cv_engine::stream:
+        return std::min(nodes * stream_bytes_per_node(opts),
+                        opts.memory_budget);
+    case cv_engine::list:
+    case cv_engine::forest:
+        return nodes * (2 * sizeof(size_t) + 2) + packed;
+    }
+    assert(false);
+    return nodes * sizeof(size_t);
+}
+
+/* Nodes per window of the streaming engine, see stream_bytes_per_node.
+ * Each window also needs some slack at the end (see there). For the packed
+ * encodings, all windows but the last consist of whole groups. */
+static size_t stream_window(const cv_opts& opts) {
+    const unsigned long long nodes =
+            opts.memory_budget / stream_bytes_per_node(opts);
+    if (nodes <= opts.rounds) {
+        return 0;
+    }
+    const size_t window = std::min(nodes - opts.rounds,
+                                   (unsigned long long)opts.length);
+    return window / cv_group_nodes(opts.encoding)
+            * cv_group_nodes(opts.encoding);
+}
+
 /* Returns a human-readable string on error, nullptr otherwise. */
 const char* cv_try_parse(cv_opts& into, const int argc, char** const argv) {
-    bool warn_length = true;
-
     /* Ignore own name, so start at 1: */
     for (int i = 1; i < argc; ++i) {
         const char* err = nullptr;
-        if (std::string("--cpus") == argv[i]) {
+        if (std::string("--alloc") == argv[i]) {
+            if ((err = advance(i, argc))) {
+                return err;
+            }
+            if (std::string("plain") == argv[i]) {
+                into.alloc = cv_alloc::plain;
+            } else if (std::string("thp") == argv[i]) {
+                into.alloc = cv_alloc::thp;
+            } else if (std::string("hugetlb") == argv[i]) {
+                into.alloc = cv_alloc::hugetlb;
+            } else if (std::string("hugetlb1g") == argv[i]) {
+                into.alloc = cv_alloc::hugetlb1g;
+            } else {
+                return "Only 'plain', 'thp', 'hugetlb', and 'hugetlb1g' are"
+                        " supported as --alloc, sorry.";
+            }
+#ifndef CV_HAVE_HUGE_PAGES
+            if (cv_alloc::plain != into.alloc) {
+                return "Sorry, huge pages are only supported on Linux.";
+            }
+#endif
+        } else if (std::string("--bench") == argv[i]) {
+            if ((err = advance(i, argc))) {
+                return err;
+            }
+            if ((err = try_stos(argv[i], into.bench_trials))) {
+                return err;
+            }
+        } else if (std::string("--bench-baseline") == argv[i]) {
+            if ((err = advance(i, argc))) {
+                return err;
+            }
+            into.bench_baseline = argv[i];
+        } else if (std::string("--bench-save") == argv[i]) {
+            if ((err = advance(i, argc))) {
+                return err;
+            }
+            into.bench_save = argv[i];
+        } else if (std::string("--bench-warmup") == argv[i]) {
+            if ((err = advance(i, argc))) {
+                return err;
+            }
+            if ((err = try_stos(argv[i], into.bench_warmup))) {
+                return err;
+            }
+        } else if (std::string("--cpus") == argv[i]) {
             if ((err = advance(i, argc))) {
                 return err;
             }
             if ((err = try_stos(argv[i], into.cpus))) {
                 return err;
             }
+        } else if (std::string("--engine") == argv[i]) {
+            if ((err = advance(i, argc))) {
+                return err;
+            }
+            if (std::string("inplace") == argv[i]) {
+                into.engine = cv_engine::inplace;
+            } else if (std::string("narrow") == argv[i]) {
+                into.engine = cv_engine::narrow;
+            } else if (std::string("fused") == argv[i]) {
+                into.engine = cv_engine::fused;
+            } else if (std::string("stream") == argv[i]) {
+                into.engine = cv_engine::stream;
+            } else if (std::string("list") == argv[i]) {
+                into.engine = cv_engine::list;
+            } else if (std::string("forest") == argv[i]) {
+                into.engine = cv_engine::forest;
+            } else {
+                return "Only 'inplace', 'narrow', 'fused', 'stream', 'list',"
+                        " and 'forest' are supported as --engine, sorry.";
+            }
+        } else if (std::string("--output-encoding") == argv[i]) {
+            if ((err = advance(i, argc))) {
+                return err;
+            }
+            if (std::string("byte") == argv[i]) {
+                into.encoding = cv_encoding::byte;
+            } else if (std::string("packed3") == argv[i]) {
+                into.encoding = cv_encoding::packed3;
+            } else if (std::string("base6") == argv[i]) {
+                into.encoding = cv_encoding::base6;
+            } else {
+                return "Only 'byte', 'packed3', and 'base6' are supported"
+                        " as --output-encoding, sorry.";
+            }
         } else if (std::string("--file-out") == argv[i]) {
             if ((err = advance(i, argc))) {
                 return err;
@@ -388,8 +2726,10 @@ const char* cv_try_parse(cv_opts& into, const int argc, char** const argv) {
             }
             if (std::string("minstd") == argv[i]) {
                 into.init_pattern_fn = fill_rnd_minstd;
+                into.init_stream = &stream_minstd;
             } else if (std::string("xorshift128plus") == argv[i]) {
                 into.init_pattern_fn = fill_rnd_xorshift128plus;
+                into.init_stream = &stream_xorshift128plus;
 /*
             } else if (std::string("whatever") == argv[i]) {
                 into.init_pattern_fn = fill_rnd_whatever;
@@ -405,6 +2745,18 @@ const char* cv_try_parse(cv_opts& into, const int argc, char** const argv) {
             if ((err = try_stos(argv[i], into.init_seed))) {
                 return err;
             }
+        } else if (std::string("--jobs") == argv[i]) {
+            if ((err = advance(i, argc))) {
+                return err;
+            }
+            into.jobs_file_name = argv[i];
+        } else if (std::string("--kernel") == argv[i]) {
+            if ((err = advance(i, argc))) {
+                return err;
+            }
+            if ((err = cv_find_kernel(argv[i], into.kernel))) {
+                return err;
+            }
         } else if (std::string("--length") == argv[i]) {
             if ((err = advance(i, argc))) {
                 return err;
@@ -413,31 +2765,127 @@ const char* cv_try_parse(cv_opts& into, const int argc, char** const argv) {
                 return err;
             }
         } else if (std::string("--length-force") == argv[i]) {
-            warn_length = false;
-        } else if (std::string("--rounds") == argv[i]) {
+            into.length_force = true;
+        } else if (std::string("--list-file") == argv[i]
+                   || std::string("--forest-file") == argv[i]) {
+            const bool forest = std::string("--forest-file") == argv[i];
             if ((err = advance(i, argc))) {
                 return err;
             }
-            if ((err = try_stos(argv[i], into.rounds))) {
-                return err;
+            into.list_file_name = argv[i];
+            into.engine = forest ? cv_engine::forest : cv_engine::list;
+            struct stat st;
+            if (stat(argv[i], &st)) {
+                return forest ? "Can't find the --forest-file."
+                        : "Can't find the --list-file.";
             }
-        } else if (std::string("--format") == argv[i]) {
+            if (0 != st.st_size % sizeof(size_t)) {
+                return forest
+                        ? "The --forest-file must consist of 64-bit numbers."
+                        : "The --list-file must consist of 64-bit numbers.";
+            }
+            into.length = st.st_size / sizeof(size_t);
+        } else if (std::string("--forest-depth") == argv[i]) {
             if ((err = advance(i, argc))) {
                 return err;
             }
-            if (std::string("none") == argv[i]) {
-                into.output_format = cv_output_format_none;
+            if ((err = try_stos(argv[i], into.forest_depth))) {
+                return err;
+            }
+        } else if (std::string("--forest-fanout") == argv[i]) {
+            if ((err = advance(i, argc))) {
+                return err;
+            }
+            if ((err = try_stos(argv[i], into.forest_fanout))) {
+                return err;
+            }
+        } else if (std::string("--list-locality") == argv[i]) {
+            if ((err = advance(i, argc))) {
+                return err;
+            }
+            if ((err = try_stos(argv[i], into.list_locality))) {
+                return err;
+            }
+        } else if (std::string("--memory-budget") == argv[i]) {
+            if ((err = advance(i, argc))) {
+                return err;
+            }
+            if ((err = try_stob(argv[i], into.memory_budget))) {
+                return err;
+            }
+        } else if (std::string("--pin") == argv[i]) {
+            if ((err = advance(i, argc))) {
+                return err;
+            }
+            if ((err = cv_pin_order(argv[i], into.pin_cpus))) {
+                return err;
+            }
+        } else if (std::string("--perf-counters") == argv[i]) {
+            into.perf_counters = true;
+        } else if (std::string("--prefault") == argv[i]) {
+            into.prefault = true;
+        } else if (std::string("--rounds") == argv[i]) {
+            if ((err = advance(i, argc))) {
+                return err;
+            }
+            into.rounds_auto = std::string("auto") == argv[i];
+            if (into.rounds_auto) {
+                /* Any 64-bit color needs at most this many. */
+                into.rounds = cv_rounds_for(~size_t(0));
+            } else if ((err = try_stos(argv[i], into.rounds))) {
+                return err;
+            }
+        } else if (std::string("--sweep") == argv[i]) {
+            if ((err = advance(i, argc))) {
+                return err;
+            }
+            into.sweeps.push_back(argv[i]);
+        } else if (std::string("--three-colors") == argv[i]) {
+            into.three_colors = true;
+        } else if (std::string("--tile") == argv[i]) {
+            if ((err = advance(i, argc))) {
+                return err;
+            }
+            if ((err = try_stos(argv[i], into.tile))) {
+                return err;
+            }
+        } else if (std::string("--format") == argv[i]) {
+            if ((err = advance(i, argc))) {
+                return err;
+            }
+            if (std::string("none") == argv[i]) {
+                into.output_format = cv_output_format_none;
             } else if (std::string("human") == argv[i]) {
                 into.output_format = cv_output_format_human;
             } else if (std::string("tdl") == argv[i]) {
                 into.output_format = cv_output_format_tdl;
+            } else if (std::string("json") == argv[i]) {
+                into.output_format = cv_output_format_json;
+            } else if (std::string("csv") == argv[i]) {
+                into.output_format = cv_output_format_csv;
 /*
             } else if (std::string("whatever") == argv[i]) {
                 into.output_format = cv_output_format_whatever;
 */
             } else {
-                return "Only 'none', 'human', and 'tdl' are supported"
-                        " as --format, sorry.";
+                return "Only 'none', 'human', 'tdl', 'json', and 'csv' are"
+                        " supported as --format, sorry.";
+            }
+        } else if (std::string("--write") == argv[i]) {
+            if ((err = advance(i, argc))) {
+                return err;
+            }
+            if (std::string("sync") == argv[i]) {
+                into.write = cv_write::sync;
+            } else if (std::string("async") == argv[i]) {
+                into.write = cv_write::async;
+            } else if (std::string("direct") == argv[i]) {
+                into.write = cv_write::direct;
+            } else if (std::string("mmap") == argv[i]) {
+                into.write = cv_write::mmap;
+            } else {
+                return "Only 'sync', 'async', 'direct', and 'mmap' are"
+                        " supported as --write, sorry.";
             }
         } else {
             printf("At option %s\n", argv[i]);
@@ -445,35 +2893,278 @@ const char* cv_try_parse(cv_opts& into, const int argc, char** const argv) {
         }
     }
 
-    if (into.cpus < 1 || into.cpus > 256) {
+    /* With --jobs, the lines of the file decide most of the options, so
+     * there's nothing to check yet. */
+    if (!into.jobs_file_name.empty()) {
+        return nullptr;
+    }
+    return cv_validate(into);
+}
+
+/* Checks whether 'opts' make sense, and prints warnings.
+ * Returns a human-readable string on error, nullptr otherwise. */
+const char* cv_validate(const cv_opts& opts) {
+    if (opts.cpus < 1 || opts.cpus > 256) {
         return "Invalid amount of cpus.";
     }
-    if (into.length < into.cpus) {
-        return "Must use at least #cpus many nodes in the list.";
+    if (opts.rounds < 1) {
+        return "Number of rounds must be positive.";
+    }
+    if (opts.length < opts.cpus * opts.rounds) {
+        return "Must use at least #cpus * #rounds many nodes in the list.";
     }
-    if (into.length > (1ULL << 28) && warn_length) {
-        printf("Warning: More that 1<<28 nodes. This means you'll need >1GiB on"
-                " 32-bit,\nand >2GiB on 64-bit platforms.\n");
+    /* The old limits were 1<<28 nodes for the warning, and 1<<31 nodes
+     * (the default --memory-budget) for the error, with 8-byte words. */
+    const unsigned long long bytes = cv_memory_needed(opts);
+    if (bytes > (1ULL << 31) && !opts.length_force) {
+        fprintf(stderr, "Warning: This needs more than 2 GiB of memory.\n");
     }
-    if (into.length > (1ULL << 31)) {
-        return "Error: More that 1<<31 nodes. This means you'll need >8GiB on"
-                " 32-bit,\nand >16GiB on 64-bit platforms.";
+    if (bytes > opts.memory_budget) {
+        return "Error: This needs more memory than --memory-budget allows."
+                " (Maybe use '--engine stream'?)";
     }
-    if (into.rounds < 1) {
-        return "Number of rounds must be positive.";
+    if (cv_engine::fused == opts.engine && !opts.init_stream->can_skip) {
+        return "The fused engine needs an --init-pattern that can skip ahead,"
+                " like 'xorshift128plus'.";
+    }
+    if (cv_engine::stream == opts.engine
+            && stream_window(opts) < opts.cpus * opts.rounds) {
+        return "The --memory-budget is too small for even a single window.";
+    }
+    if (opts.tile < 1) {
+        return "The tile must be at least one position wide.";
+    }
+    if (opts.forest_fanout < 1) {
+        return "The --forest-fanout must be at least 1.";
+    }
+    /* See the table at --rounds: after round 3, the colors of 64-bit
+     * numbers are in 0..7, and after round 4 in 0..5. */
+    if (cv_encoding::packed3 == opts.encoding && opts.rounds < 3) {
+        return "The packed3 encoding needs at least 3 rounds.";
+    }
+    if (cv_encoding::base6 == opts.encoding && opts.rounds < 4) {
+        return "The base6 encoding needs at least 4 rounds.";
+    }
+    if (opts.three_colors && opts.rounds < 4) {
+        return "--three-colors needs at least 4 rounds, to start from 6"
+                " colors.";
+    }
+    if (opts.three_colors && cv_engine::inplace != opts.engine
+            && cv_engine::narrow != opts.engine) {
+        return "--three-colors only works with the inplace and narrow"
+                " engines, sorry.";
+    }
+    if (opts.rounds < 4 && !opts.rounds_auto) {
+        fprintf(stderr, "Warning: with this few rounds, you may not end up"
+                " with >= 6 colors.\n");
+    }
+
+    return nullptr;
+}
+
+/* Reads the file named by base.jobs_file_name. Each job is a copy of 'base'
+ * with the seed, length, rounds (or 'auto'), and cpus of its line.
+ * Returns a human-readable string on error, nullptr otherwise. */
+const char* cv_try_parse_jobs(const cv_opts& base, std::vector<cv_opts>& into) {
+    FILE* fp = fopen64(base.jobs_file_name.c_str(), "r");
+    if (!fp) {
+        return "Can't open the --jobs file.";
+    }
+
+    const char* err = nullptr;
+    char line[256];
+    size_t lineno = 0;
+    while (!err && fgets(line, sizeof(line), fp)) {
+        ++lineno;
+        cv_opts job = base;
+        job.jobs_file_name.clear();
+        size_t* const targets[4] = {&job.init_seed, &job.length,
+                                    &job.rounds, &job.cpus};
+        size_t found = 0;
+        for (char* tok = strtok(line, " \t\r\n"); tok;
+                tok = strtok(nullptr, " \t\r\n")) {
+            if (0 == found && '#' == tok[0]) {
+                break;
+            }
+            if (found == 4) {
+                err = "Too many numbers in a line of the --jobs file.";
+                break;
+            }
+            /* The job's rounds win over '--rounds auto', and may be 'auto'
+             * themselves. */
+            if (2 == found) {
+                job.rounds_auto = std::string("auto") == tok;
+            }
+            if (2 == found && job.rounds_auto) {
+                job.rounds = cv_rounds_for(~size_t(0));
+            } else if ((err = try_stos(tok, *targets[found]))) {
+                break;
+            }
+            ++found;
+        }
+        if (!err && found != 0 && found != 4) {
+            err = "Each line of the --jobs file needs"
+                    " '<seed> <length> <rounds> <cpus>'.";
+        }
+        if (!err && found == 4) {
+            err = cv_validate(job);
+            into.push_back(job);
+        }
+        if (err) {
+            printf("In line %ld of the --jobs file:\n", lineno);
+        }
     }
-    if (into.rounds < 4) {
-        printf("Warning: with this few rounds, you may not end up with >= 6 colors.\n");
+    fclose(fp);
+    if (!err && into.empty()) {
+        err = "The --jobs file doesn't contain any jobs.";
     }
+    return err;
+}
+
+const char* cv_expand_sweeps(const std::vector<std::string>& sweeps,
+                             std::vector<cv_opts>& jobs) {
+    /* Errors mention the sweep, so they have to live somewhere. */
+    static std::string message;
+    /* The last sweep is expanded first, so it's the innermost. */
+    for (size_t s = sweeps.size(); s-- > 0;) {
+        const std::string& sweep = sweeps[s];
+        const size_t eq = sweep.find('=');
+        if (std::string::npos == eq || 0 == eq || eq + 1 == sweep.size()) {
+            return "--sweep needs '<option>=<value>,<value>,...'.";
+        }
+        std::string flag = "--" + sweep.substr(0, eq);
+        /* These apply to the pool or the whole invocation, not to a job. */
+        for (const char* const global : {"--pin", "--jobs", "--prefault",
+                                         "--sweep", "--format", "--help"}) {
+            if (global == flag) {
+                message = "Can't --sweep " + flag + ", it's not per job.";
+                return message.c_str();
+            }
+        }
+        if (0 == flag.find("--bench")) {
+            message = "Can't --sweep " + flag + ", it's not per job.";
+            return message.c_str();
+        }
+        std::vector<std::string> values;
+        for (size_t from = eq + 1; from <= sweep.size();) {
+            const size_t comma = std::min(sweep.find(',', from), sweep.size());
+            values.push_back(sweep.substr(from, comma - from));
+            from = comma + 1;
+        }
 
+        std::vector<cv_opts> expanded;
+        for (const cv_opts& job : jobs) {
+            for (std::string& value : values) {
+                cv_opts copy = job;
+                char* args[] = {const_cast<char*>("cv"), &flag[0], &value[0]};
+                const char* const err = cv_try_parse(copy, 3, args);
+                if (err) {
+                    message = "In --sweep " + sweep + ":\n" + err;
+                    return message.c_str();
+                }
+                expanded.push_back(copy);
+            }
+        }
+        jobs.swap(expanded);
+    }
     return nullptr;
 }
 
 
 /* ===== Control worker threads ===== */
 
-void cv_start_and_join_workers(size_t* const begin, const size_t length,
-                               const size_t cpus, const size_t rounds) {
+cv_pool::cv_pool(const size_t threads, const std::vector<int>& pin_cpus) {
+    for (size_t i = 0; i < threads; ++i) {
+        workers.emplace_back(&cv_pool::work, this, i);
+#ifdef CV_HAVE_AFFINITY
+        if (pin_cpus.empty()) {
+            continue;
+        }
+        /* The worker may already be running, but it's only sleeping yet. */
+        const int cpu = pin_cpus[i % pin_cpus.size()];
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (pthread_setaffinity_np(workers.back().native_handle(),
+                                   sizeof(set), &set)) {
+            fprintf(stderr, "Warning: Couldn't pin worker %ld to CPU %d.\n",
+                    i, cpu);
+        }
+#else
+        (void)pin_cpus;
+#endif
+    }
+}
+
+cv_pool::~cv_pool() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    wake.notify_all();
+    for (std::thread& t : workers) {
+        t.join();
+    }
+}
+
+void cv_pool::run(const size_t n, const std::function<void(size_t)>& task) {
+    assert(n <= size());
+    std::unique_lock<std::mutex> lock(mutex);
+    this->task = &task;
+    active = n;
+    pending = n;
+    ++generation;
+    wake.notify_all();
+    done.wait(lock, [this]() { return 0 == pending; });
+    this->task = nullptr;
+}
+
+/* Each worker sleeps until the generation changes. Workers beyond 'active'
+ * just go back to sleep. */
+void cv_pool::work(const size_t id) {
+    size_t seen = 0;
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [this, &seen]() {
+            return quit || generation != seen;
+        });
+        if (quit) {
+            return;
+        }
+        seen = generation;
+        if (id >= active) {
+            continue;
+        }
+        const std::function<void(size_t)>* const todo = task;
+        lock.unlock();
+        (*todo)(id);
+        lock.lock();
+        if (0 == --pending) {
+            done.notify_all();
+        }
+    }
+}
+
+/* Runs task(0) to task(n-1) in parallel, and waits for all of them.
+ * Without a pool (or with one that's too small), each gets a fresh thread. */
+static void run_parallel(cv_pool* const pool, const size_t n,
+                         const std::function<void(size_t)>& task) {
+    if (pool && n <= pool->size()) {
+        pool->run(n, task);
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < n; ++i) {
+        threads.emplace_back(task, i);
+    }
+    for (std::thread& t : threads) {
+        t.join();
+    }
+}
+
+/* Chunk i of the list is [border[i], border[i+1]). */
+static std::vector<size_t> compute_borders(const size_t length,
+                                           const size_t cpus) {
     std::vector<size_t> border;
     border.emplace_back(0);
     for (size_t i = 1; i < 1 + cpus; ++i) {
@@ -483,118 +3174,2096 @@ void cv_start_and_join_workers(size_t* const begin, const size_t length,
             abort();
         }
     }
+    return border;
+}
+
+/* OR-ing a piece right after it was generated means it's still in L1. */
+static const size_t combine_piece = 4096;
+
+static size_t combine(const size_t* const begin, const size_t count) {
+    size_t combined = 0;
+    for (size_t i = 0; i < count; ++i) {
+        combined |= begin[i];
+    }
+    return combined;
+}
+
+/* Generates the colors of positions [from, from+count) into 'into',
+ * split into 'cpus' chunks. Only for streams which can skip ahead.
+ * See cv_fill_parallel for 'combined'. */
+static void generate_parallel(const cv_stream* stream, const size_t seed,
+                              size_t* const into, const size_t from,
+                              const size_t count, const size_t cpus,
+                              cv_pool* const pool,
+                              size_t* const combined = nullptr) {
+    assert(stream->can_skip);
+    const std::vector<size_t> border = compute_borders(count, cpus);
+    std::vector<size_t> parts(cpus);
+    run_parallel(pool, cpus, [&](size_t i) {
+        size_t state[2];
+        stream->seek(state, seed, from + border[i]);
+        if (!combined) {
+            stream->generate(state, into + border[i],
+                             border[i + 1] - border[i]);
+            return;
+        }
+        for (size_t p = border[i]; p < border[i + 1]; p += combine_piece) {
+            const size_t n = std::min(combine_piece, border[i + 1] - p);
+            stream->generate(state, into + p, n);
+            parts[i] |= combine(into + p, n);
+        }
+    });
+    if (combined) {
+        *combined = combine(parts.data(), cpus);
+    }
+}
+
+size_t cv_combine_parallel(const size_t* const begin, const size_t length,
+                           const size_t cpus, cv_pool* const pool) {
+    const std::vector<size_t> border = compute_borders(length, cpus);
+    std::vector<size_t> parts(cpus);
+    run_parallel(pool, cpus, [&](size_t i) {
+        parts[i] = combine(begin + border[i], border[i + 1] - border[i]);
+    });
+    return combine(parts.data(), cpus);
+}
+
+/* Uses the same chunks as cv_start_and_join_workers, so each chunk is
+ * touched first by "its" thread, which places it on that thread's NUMA node.
+ * Falls back to the sequential fill_fn if the stream can't skip ahead. */
+void cv_fill_parallel(size_t* const begin, const size_t length,
+                      const size_t cpus, const size_t seed,
+                      cv_fill_fn_t fill_fn, const cv_stream* stream,
+                      cv_pool* const pool, size_t* const combined) {
+    if (!stream || !stream->can_skip) {
+        fill_fn(begin, length, seed);
+        if (combined) {
+            *combined = cv_combine_parallel(begin, length, cpus, pool);
+        }
+        return;
+    }
+
+    generate_parallel(stream, seed, begin, 0, length, cpus, pool, combined);
+
+#ifndef NDEBUG
+    /* The sequential fill skips collisions, which shifts everything after
+     * them. That can't be done in parallel, so just start over. */
+    for (size_t i = 0; i < length; ++i) {
+        if (begin[i] == begin[(i + 1) % length]) {
+            fill_fn(begin, length, seed);
+            if (combined) {
+                *combined = cv_combine_parallel(begin, length, cpus, pool);
+            }
+            return;
+        }
+    }
+#endif
+}
+
+/* cv_start_and_join_workers, for either representation of run_chunk. The
+ * original colors in 'in' are only read, and in-place, 'out == in'. */
+template <typename T>
+static void start_and_join_chunks(const size_t* const in, T* const out,
+                                  const size_t length, const size_t cpus,
+                                  const size_t rounds,
+                                  const cv_kernel* kernel, const size_t tile,
+                                  const size_t* const tail,
+                                  cv_pool* const pool, const bool compact,
+                                  const cv_chunk_done_fn_t& chunk_done,
+                                  cv_profile* const profile,
+                                  const bool three) {
+    const std::vector<size_t> border = compute_borders(length, cpus);
 
+    const my_clock_t::time_point clock_borders = my_clock_t::now();
     std::vector<std::vector<size_t>> buf;
     for (size_t i = 0; i < cpus; ++i) {
         buf.emplace_back();
         /* Should compute offsets and batch-insert.
-         * But 'rounds' is small enough, so it doesn't matter. */
+         * But 'rounds' is small enough, so it doesn't matter.
+         * Without a 'tail', the list is a ring. */
         for (size_t j = 0, pos = border[i + 1]; j < rounds; ++j, ++pos) {
+            if (pos >= length && tail) {
+                buf.back().push_back(tail[pos - length]);
+                continue;
+            }
             if (pos >= length) {
                 pos -= length;
             }
-            buf.back().push_back(begin[pos]);
+            buf.back().push_back(in[pos]);
         }
         assert(buf.back().size() == rounds);
     }
+    /* For the 6-to-3 reduction, each chunk also needs the final colors of
+     * the 3 nodes on either side. These are cheap to compute right here. */
+    std::vector<std::vector<size_t>> context(three ? cpus : 0);
+    assert(!three || !tail);
+    /* In-place, the reduced bytes end up where 'compact' puts them. */
+    assert(!three || sizeof(T) == 1 || compact);
+    assert(!compact || sizeof(T) != 1);
+    for (size_t i = 0; i < context.size(); ++i) {
+        for (size_t from : {border[i] + length - 3, border[i + 1]}) {
+            std::vector<size_t> colors;
+            for (size_t j = 0; j < 3 + rounds; ++j) {
+                colors.push_back(in[(from + j) % length]);
+            }
+            for (size_t r = 0; r < rounds; ++r) {
+                for (size_t j = 0; j + 1 < colors.size() - r; ++j) {
+                    compute_cv(&colors[j], &colors[j + 1]);
+                }
+            }
+            context[i].insert(context[i].end(), colors.begin(),
+                              colors.begin() + 3);
+        }
+    }
+    cv_thread_times* times = nullptr;
+    if (profile) {
+        profile->ns_borders += duration_to_ns(my_clock_t::now() - clock_borders);
+        if (profile->threads.size() < cpus) {
+            profile->threads.resize(cpus);
+        }
+        times = profile->threads.data();
+    }
 
-    /* This already starts the workers, not only allocates them! */
-    std::vector<std::thread> threads;
-    for (size_t i = 0; i < cpus; ++i) {
-        /*run_chunk(size_t* const begin, size_t* const end,
-                              std::vector<size_t> following)*/
-        threads.emplace_back(run_chunk, begin + border[i],
-                border[i + 1] - border[i], std::move(buf[i]));
+    run_parallel(pool, cpus, [&](size_t i) {
+        /*run_chunk(const size_t* const in, T* const out,
+                      size_t const length, std::vector<size_t> following,
+                      const cv_kernel* const kernel, const size_t tile,
+                      cv_thread_times* const times)*/
+        cv_thread_times* const mine = times ? times + i : nullptr;
+        const size_t* const three_context = three ? context[i].data()
+                                                  : nullptr;
+        run_chunk<T>(in + border[i], out + border[i],
+                     border[i + 1] - border[i], std::move(buf[i]), kernel,
+                     tile, mine, three_context);
+        const my_clock_t::time_point clock_narrow = my_clock_t::now();
+        /* No-one else looks at this chunk anymore, and it's still hot.
+         * With 'three', run_chunk already did that. */
+        if (compact && !three) {
+            narrow_in_place(kernel,
+                            reinterpret_cast<unsigned char*>(out + border[i]),
+                            out + border[i], 0, border[i + 1] - border[i]);
+        }
+        if (chunk_done) {
+            chunk_done(border[i], border[i + 1]);
+        }
+        if (mine) {
+            mine->ns_narrow += duration_to_ns(my_clock_t::now() - clock_narrow);
+        }
+    });
+}
+
+void cv_start_and_join_workers(size_t* const begin, const size_t length,
+                               const size_t cpus, const size_t rounds,
+                               const cv_kernel* kernel, const size_t tile,
+                               unsigned char* const narrow_out,
+                               const size_t* const tail, cv_pool* const pool,
+                               const bool compact,
+                               const cv_chunk_done_fn_t& chunk_done,
+                               cv_profile* const profile, const bool three) {
+    if (narrow_out) {
+        start_and_join_chunks<unsigned char>(begin, narrow_out, length, cpus,
+                rounds, kernel, tile, tail, pool, compact, chunk_done,
+                profile, three);
+    } else {
+        start_and_join_chunks<size_t>(begin, begin, length, cpus, rounds,
+                kernel, tile, tail, pool, compact, chunk_done, profile,
+                three);
     }
+}
 
-    for (std::thread& t : threads) {
-        t.join();
+void cv_start_and_join_fused(const cv_stream* stream, const size_t seed,
+                             const size_t length, const size_t cpus,
+                             const size_t rounds, unsigned char* const out,
+                             const cv_kernel* kernel, const size_t tile,
+                             cv_pool* const pool,
+                             const cv_chunk_done_fn_t& chunk_done,
+                             cv_profile* const profile) {
+    const std::vector<size_t> border = compute_borders(length, cpus);
+    cv_thread_times* times = nullptr;
+    if (profile) {
+        if (profile->threads.size() < cpus) {
+            profile->threads.resize(cpus);
+        }
+        times = profile->threads.data();
     }
+    run_parallel(pool, cpus, [&](size_t i) {
+        cv_thread_times* const mine = times ? times + i : nullptr;
+        run_chunk_fused(stream, seed, length, border[i], border[i + 1], rounds,
+                out ? out + border[i] : nullptr, kernel, tile, mine);
+        const my_clock_t::time_point clock_narrow = my_clock_t::now();
+        if (chunk_done) {
+            chunk_done(border[i], border[i + 1]);
+        }
+        if (mine) {
+            mine->ns_narrow += duration_to_ns(my_clock_t::now() - clock_narrow);
+        }
+    });
 }
 
+/* Like cv_pack, but split into 'cpus' pieces of whole groups. */
+void cv_pack_parallel(unsigned char* const out, const unsigned char* const in,
+                      const size_t count, const cv_encoding encoding,
+                      const size_t cpus, cv_pool* const pool) {
+    const size_t group = cv_group_nodes(encoding);
+    const size_t group_bytes = cv_encoded_size(group, encoding);
+    const std::vector<size_t> border = compute_borders(
+            (count + group - 1) / group, cpus);
+    run_parallel(pool, cpus, [&](size_t i) {
+        const size_t from = border[i] * group;
+        const size_t to = std::min(count, border[i + 1] * group);
+        if (from >= to) {
+            return;
+        }
+        unsigned char* const dest = out + border[i] * group_bytes;
+        cv_pack(dest, in + from, to - from, encoding);
+#ifndef NDEBUG
+        std::vector<unsigned char> check(to - from);
+        cv_unpack(check.data(), dest, to - from, encoding);
+        assert(std::equal(check.begin(), check.end(), in + from));
+#endif
+    });
+}
 
-/* ===== Write to file ===== */
 
-const char* cv_write_file(size_t* const begin, const size_t length,
-                const std::string& file_out_name) {
-    FILE* fp = fopen64(file_out_name.c_str(), "wb");
-    if (!fp) {
-        return "fopen failed. (Bad filename? Write permissions?)";
+/* ===== Streaming engine ===== */
+
+/* Processes the list in windows of at most 'window' nodes, so that only one
+ * window at a time needs to be in memory, and writes each window's colors
+ * to the file as soon as it's done. For cv_start_and_join_workers, a window
+ * is just a shorter list. Its last chunk gets the original colors of the next
+ * window's first nodes as 'following', exactly like any other chunk gets
+ * them from its neighbor. Only the last window wraps around, and gets the
+ * first nodes of the list, which are kept around since the first window.
+ *
+ * The original colors come from the stream, and since the windows are done
+ * in order, this works even if the stream can't skip ahead. If it can, each
+ * window is generated in parallel. */
+const char* cv_start_and_join_streaming(const cv_stream* stream,
+                                        const size_t seed, const size_t length,
+                                        const size_t cpus, const size_t rounds,
+                                        const size_t window,
+                                        const std::string& file_out_name,
+                                        const cv_kernel* kernel,
+                                        const size_t tile, cv_pool* const pool,
+                                        const cv_write write,
+                                        const cv_encoding encoding,
+                                        cv_profile* const profile) {
+    /* Windows (but the last one) consist of whole groups, so each one
+     * starts at a whole byte in the file. */
+    const bool packing = cv_encoding::byte != encoding;
+    const size_t group = cv_group_nodes(encoding);
+    const size_t group_bytes = cv_encoded_size(group, encoding);
+    assert(0 == window % group);
+    const size_t header_size = packing ? cv_header_size : 0;
+
+    /* With a mapping, the windows go right into the file. Otherwise, the
+     * previous window can be written in the background while this one is
+     * computed, which needs a second output buffer. */
+    cv_mapping mapping;
+    if (cv_write::mmap == write) {
+        const char* err = mapping.open(file_out_name,
+                header_size + cv_encoded_size(length, encoding));
+        if (err) {
+            return err;
+        }
+    }
+    unsigned char* const map = mapping.data();
+    cv_writer writer;
+    FILE* fp = nullptr;
+    bool async = cv_write::sync != write && !map;
+    if (async) {
+        const char* err = writer.open(file_out_name,
+                                      cv_write::direct == write);
+        if (err) {
+            return err;
+        }
+        if (!writer.seekable()) {
+            writer.close();
+            async = false;
+        }
+    }
+    if (!async && !map) {
+        fp = fopen64(file_out_name.c_str(), "wb");
+        if (!fp) {
+            return "fopen failed. (Bad filename? Write permissions?)";
+        }
     }
 
-    /* Shamelessly overwrite old data. The only collision happens at the very
-     * first operation, and here it is okay, too, because it's cached. */
-    unsigned char* data = reinterpret_cast<unsigned char*>(begin);
-    for (size_t i = 0; i < length; ++i) {
-        data[i] = (unsigned char)begin[i];
+    unsigned char header[cv_header_size];
+    if (packing) {
+        cv_encode_header(map ? map : header, encoding, length, rounds, seed);
+        if (map) {
+            /* Already there. */
+        } else if (async) {
+            writer.submit(header, cv_header_size, 0);
+        } else if (fwrite(header, 1, cv_header_size, fp) != cv_header_size) {
+            fclose(fp);
+            return "Writing the output failed.";
+        }
+    }
+
+    /* A window may grow by up to 'rounds - 1' nodes, so that the next one
+     * doesn't end up too short. The buffers are freed in bulk. */
+    const size_t buffers = async ? 2 : 1;
+    std::vector<void*> allocated;
+    allocated.push_back(malloc((window + rounds) * sizeof(size_t)));
+    for (size_t i = 0; i < buffers * (packing ? 2 : 1); ++i) {
+        allocated.push_back(malloc(window + rounds));
     }
+    if (std::find(allocated.begin(), allocated.end(), nullptr)
+            != allocated.end()) {
+        for (void* ptr : allocated) {
+            free(ptr);
+        }
+        if (async) {
+            writer.close();
+        } else if (fp) {
+            fclose(fp);
+        }
+        return "malloc failed!";
+    }
+    size_t* const colors = static_cast<size_t*>(allocated[0]);
+    unsigned char* const out[2] = {
+        static_cast<unsigned char*>(allocated[1]),
+        static_cast<unsigned char*>(allocated[buffers])
+    };
+    unsigned char* const packed[2] = {
+        packing ? static_cast<unsigned char*>(allocated[1 + buffers]) : out[0],
+        packing ? static_cast<unsigned char*>(allocated[2 * buffers]) : out[1]
+    };
 
-    const size_t written = fwrite(begin, 1, length, fp);
+    std::vector<size_t> head;
+    std::vector<size_t> following(rounds);
+    size_t state[2];
+    stream->seek(state, seed, 0);
+    /* How many colors of the current window are already known. */
+    size_t known = 0;
+    const char* err = nullptr;
+    for (size_t w_begin = 0, w_index = 0; w_begin < length && !err;
+            ++w_index) {
+        size_t n = std::min(window, length - w_begin);
+        if (length - (w_begin + n) < rounds) {
+            n = length - w_begin;
+        }
+        const my_clock_t::time_point clock_fill = my_clock_t::now();
+        if (stream->can_skip) {
+            generate_parallel(stream, seed, colors + known, w_begin + known,
+                              n - known, cpus, pool);
+            stream->seek(state, seed, w_begin + n);
+        } else {
+            stream->generate(state, colors + known, n - known);
+        }
+        if (head.empty()) {
+            head.assign(colors, colors + rounds);
+        }
 
-    if (written != length) {
-        printf("Wrote only %ld of %ld bytes. errno is %d. ferror is %d.\n",
-                written, length, errno, ferror(fp));
+        /* The original colors of the nodes after this window. */
+        const size_t ahead = std::min(rounds, length - (w_begin + n));
+        stream->generate(state, following.data(), ahead);
+        std::copy(head.begin(), head.begin() + (rounds - ahead),
+                  following.begin() + ahead);
+        if (profile) {
+            profile->ns_fill += duration_to_ns(my_clock_t::now() - clock_fill);
+        }
+
+        /* Only the window before this one may still be in flight, and it
+         * uses the other buffer. */
+        unsigned char* const dest = map && !packing ? map + w_begin
+                : out[w_index % 2];
+        if (async) {
+            writer.drain(1);
+        }
+        const size_t w_cpus = std::max<size_t>(1, std::min(cpus, n / rounds));
+        cv_start_and_join_workers(colors, n, w_cpus, rounds, kernel, tile,
+                                  dest, following.data(), pool, false,
+                                  cv_chunk_done_fn_t(), profile);
+
+        const size_t offset = header_size + w_begin / group * group_bytes;
+        unsigned char* const data = !packing ? dest
+                : map ? map + offset : packed[w_index % 2];
+        const size_t bytes = cv_encoded_size(n, encoding);
+        if (packing) {
+            cv_pack_parallel(data, dest, n, encoding, cpus, pool);
+        }
+        if (map) {
+            /* Already there. */
+        } else if (async) {
+            writer.submit(data, bytes, offset);
+        } else if (fwrite(data, 1, bytes, fp) != bytes) {
+            err = "Writing the output failed.";
+        }
+        std::copy(following.begin(), following.begin() + ahead, colors);
+        known = ahead;
+        w_begin += n;
     }
 
-    if (fclose(fp)) {
-        printf("Closing failed, data might be incomplete(?)");
+    if (map) {
+        const char* close_err = mapping.close();
+        err = err ? err : close_err;
+    } else if (async) {
+        const char* close_err = writer.close();
+        err = err ? err : close_err;
+    } else if (fclose(fp) && !err) {
+        err = "Closing failed, data might be incomplete(?)";
     }
-    return nullptr;
+    for (void* ptr : allocated) {
+        free(ptr);
+    }
+    return err;
 }
 
 
-/* ===== Holistic ===== */
+/* ===== Linked lists ===== */
 
-typedef std::chrono::high_resolution_clock my_clock_t;
+/* Good enough for shuffling, and trivial to seed per window. */
+static inline uint64_t splitmix64(uint64_t& state) {
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
 
-// explain(clock_finish - clock_init, "<All>");
-static size_t duration_to_ms(const my_clock_t::duration dur) {
-    return std::chrono::duration_cast<std::chrono::milliseconds>(dur).count();
+/* order[k] becomes the node at position k. Each window is shuffled on its
+ * own, so they can go in parallel. */
+static void shuffle_windows(size_t* const order, const size_t length,
+                            const size_t locality, const size_t seed,
+                            const size_t cpus, cv_pool* const pool) {
+    const size_t window = 0 == locality ? length : std::min(locality, length);
+    const size_t windows = (length + window - 1) / window;
+    const size_t parts = std::min(cpus, windows);
+    const std::vector<size_t> part = compute_borders(windows, parts);
+    run_parallel(pool, parts, [&](size_t i) {
+        for (size_t w = part[i]; w < part[i + 1]; ++w) {
+            const size_t from = w * window;
+            const size_t count = std::min(window, length - from);
+            for (size_t k = 0; k < count; ++k) {
+                order[from + k] = from + k;
+            }
+            uint64_t state = seed ^ (w * 0xD1B54A32D192ED03ULL);
+            for (size_t k = count; k > 1; --k) {
+                std::swap(order[from + k - 1],
+                          order[from + splitmix64(state) % k]);
+            }
+        }
+    });
 }
 
-int cv_main(int argc, char **argv, bool print_errors) {
-    const my_clock_t::time_point clock_init = my_clock_t::now();
+void cv_generate_list(size_t* const next, size_t* const temp,
+                      const size_t length, const size_t locality,
+                      const size_t seed, const size_t cpus,
+                      cv_pool* const pool) {
+    size_t* const order = temp;
+    shuffle_windows(order, length, locality, seed, cpus, pool);
+    const std::vector<size_t> border = compute_borders(length, cpus);
+    run_parallel(pool, cpus, [&](size_t i) {
+        for (size_t k = border[i]; k < border[i + 1]; ++k) {
+            next[order[k]] = order[k + 1 == length ? 0 : k + 1];
+        }
+    });
+}
 
-    cv_opts opts;
-    const char* err = cv_try_parse(opts, argc, argv);
-    if (err) {
-        if (print_errors) {
-            printf("%s\n", err);
+void cv_generate_forest(size_t* const parent, size_t* const temp,
+                        const size_t length, const size_t depth,
+                        const size_t fanout, const size_t locality,
+                        const size_t seed, const size_t cpus,
+                        cv_pool* const pool) {
+    /* Level l of each tree starts at position start[l]. With a fanout of
+     * 1, that would be one entry per node, so these are just paths. */
+    std::vector<size_t> start(1, 0);
+    size_t tree = length;
+    if (fanout > 1) {
+        for (size_t width = 1; start.back() < length;) {
+            start.push_back(start.back() + width);
+            width = width > length / fanout ? length : width * fanout;
+            if (depth && start.size() == depth + 2) {
+                break;
+            }
         }
-        return 1;
+        tree = std::min(start.back(), length);
+    } else if (depth) {
+        tree = std::min(depth + 1, length);
     }
 
-    /* Use malloc since I don't want to use try/catch. */
-    size_t* arr = static_cast<size_t*>(malloc(opts.length * sizeof(size_t)));
-    if (!arr) {
-        if (print_errors) {
-            printf("malloc failed!\n");
+    size_t* const order = temp;
+    shuffle_windows(order, length, locality, seed, cpus, pool);
+    const std::vector<size_t> border = compute_borders(length, cpus);
+    run_parallel(pool, cpus, [&](size_t i) {
+        for (size_t k = border[i]; k < border[i + 1]; ++k) {
+            const size_t base = k - k % tree;
+            const size_t pos = k - base;
+            size_t up = 0;
+            if (fanout == 1) {
+                up = pos ? pos - 1 : 0;
+            } else if (pos) {
+                /* The level above is complete, since it comes first. */
+                const size_t level = std::upper_bound(start.begin(),
+                        start.end(), pos) - start.begin() - 1;
+                uint64_t state = seed ^ (k * 0xD1B54A32D192ED03ULL);
+                up = start[level - 1] + splitmix64(state)
+                        % (start[level] - start[level - 1]);
+            }
+            parent[order[k]] = order[base + up];
         }
-        return 2;
-    }
+    });
+}
 
-    opts.init_pattern_fn(arr, opts.length, opts.init_seed);
-    const my_clock_t::time_point clock_ready = my_clock_t::now();
+const char* cv_load_list(const std::string& file_name, size_t* const next,
+                         const size_t length, const bool roots) {
+    FILE* fp = fopen64(file_name.c_str(), "rb");
+    if (!fp) {
+        return roots ? "Can't open the --forest-file."
+                : "Can't open the --list-file.";
+    }
+    const size_t got = fread(next, sizeof(size_t), length, fp);
+    fclose(fp);
+    if (got != length) {
+        return roots ? "Reading the --forest-file failed."
+                : "Reading the --list-file failed.";
+    }
+    for (size_t i = 0; i < length; ++i) {
+        if (next[i] >= length || (next[i] == i && !roots)) {
+            return roots ? "The --forest-file contains an invalid parent."
+                    : "The --list-file contains an invalid successor.";
+        }
+    }
+    return nullptr;
+}
 
-    cv_start_and_join_workers(arr, opts.length, opts.cpus, opts.rounds);
-    const my_clock_t::time_point clock_done = my_clock_t::now();
+/* Each successor's color is probably a cache miss, so while one batch is
+ * computed, the colors for the next one are already on their way. */
+static const size_t list_batch = 32;
 
-    err = cv_write_file(arr, opts.length, opts.file_out_name);
-    free(arr);
-    if (err) {
-        if (print_errors) {
-            printf("%s\n", err);
+/* One round for the nodes [from, to), from 'in' to 'out'. With 'roots',
+ * see cv_start_and_join_list. */
+template <bool roots = false, typename T>
+static void list_round(unsigned char* const out, const T* const in,
+                       const size_t* const next, const size_t from,
+                       const size_t to) {
+    for (size_t j = from; j < std::min(from + list_batch, to); ++j) {
+        __builtin_prefetch(in + next[j]);
+    }
+    for (size_t i = from; i < to; i += list_batch) {
+        const size_t end = std::min(i + list_batch, to);
+        const size_t ahead = std::min(end + list_batch, to);
+        for (size_t j = end; j < ahead; ++j) {
+            __builtin_prefetch(in + next[j]);
+        }
+        for (size_t j = i; j < end; ++j) {
+            const size_t with = roots && next[j] == j
+                    ? in[j] ^ 1 : in[next[j]];
+            out[j] = static_cast<unsigned char>(cv_step(in[j], with));
         }
-        return 3;
     }
-    const my_clock_t::time_point clock_finish = my_clock_t::now();
+}
 
-    /* Output statistics: */
-    const size_t ms_init = duration_to_ms(clock_ready - clock_init);
-    const size_t ms_cv = duration_to_ms(clock_done - clock_ready);
-    const size_t ms_cleanup = duration_to_ms(clock_finish - clock_done);
-    const size_t ms_all = duration_to_ms(clock_finish - clock_init);
-    printf(opts.output_format.c_str(), ms_init, ms_cv, ms_cleanup, ms_all);
+/* Unlike the ring, a round can't be done in-place, since any node may be
+ * anyone's successor. So the rounds alternate between 'scratch' and 'out',
+ * such that the last one lands in 'out'. All but the first one are on
+ * bytes, which makes the gathers a bit cheaper. */
+void cv_start_and_join_list(const size_t* const next,
+                            const size_t* const colors, const size_t length,
+                            const size_t cpus, const size_t rounds,
+                            unsigned char* const out,
+                            unsigned char* const scratch,
+                            cv_pool* const pool,
+                            const cv_chunk_done_fn_t& chunk_done,
+                            cv_profile* const profile, const bool roots) {
+    const std::vector<size_t> border = compute_borders(length, cpus);
+    if (profile && profile->threads.size() < cpus) {
+        profile->threads.resize(cpus);
+    }
+    const unsigned char* prev = nullptr;
+    for (size_t r = 0; r < rounds; ++r) {
+        unsigned char* const into = (rounds - r) % 2 ? out : scratch;
+        const bool last = r + 1 == rounds;
+        run_parallel(pool, cpus, [&](size_t i) {
+            const my_clock_t::time_point clock_main = my_clock_t::now();
+            if (0 == r && roots) {
+                list_round<true>(into, colors, next, border[i], border[i + 1]);
+            } else if (0 == r) {
+                list_round(into, colors, next, border[i], border[i + 1]);
+            } else if (roots) {
+                list_round<true>(into, prev, next, border[i], border[i + 1]);
+            } else {
+                list_round(into, prev, next, border[i], border[i + 1]);
+            }
+            const my_clock_t::time_point clock_done = my_clock_t::now();
+            if (last && chunk_done) {
+                chunk_done(border[i], border[i + 1]);
+            }
+            if (profile) {
+                cv_thread_times& mine = profile->threads[i];
+                mine.ns_main += duration_to_ns(clock_done - clock_main);
+                mine.ns_narrow += duration_to_ns(my_clock_t::now()
+                                                 - clock_done);
+            }
+        });
+        prev = into;
+    }
+}
+
+
+/* ===== Write to file ===== */
+
+/* O_DIRECT wants the memory, the file offset, and the length aligned to the
+ * logical block size. A page is a safe bet. */
+static const size_t direct_align = 4096;
+
+static bool pwrite_all(const int fd, const unsigned char* data, size_t length,
+                       size_t offset) {
+    while (length) {
+        const ssize_t n = pwrite64(fd, data, length, offset);
+        if (n < 0 && EINTR == errno) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        length -= n;
+        offset += n;
+    }
+    return true;
+}
+
+cv_writer::~cv_writer() {
+    close();
+}
+
+const char* cv_writer::open(const std::string& file_out_name,
+                            const bool direct) {
+    assert(fd < 0);
+    fd = ::open(file_out_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        return "open failed. (Bad filename? Write permissions?)";
+    }
+    can_seek = lseek64(fd, 0, SEEK_CUR) >= 0;
+#ifdef O_DIRECT
+    /* Not every file system supports it (e.g. tmpfs), but that's okay:
+     * then everything goes through 'fd'. */
+    if (direct && can_seek) {
+        direct_fd = ::open(file_out_name.c_str(), O_WRONLY | O_DIRECT);
+    }
+#else
+    (void)direct;
+#endif
+    quit = false;
+    err = nullptr;
+    thread = std::thread(&cv_writer::work, this);
+    return nullptr;
+}
+
+void cv_writer::submit(const unsigned char* const data, const size_t length,
+                       const size_t offset) {
+    assert(can_seek);
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(piece{data, length, offset});
+        ++pending;
+    }
+    wake.notify_one();
+}
+
+void cv_writer::drain(const size_t max_pending) {
+    std::unique_lock<std::mutex> lock(mutex);
+    done.wait(lock, [this, max_pending]() { return pending <= max_pending; });
+}
+
+const char* cv_writer::close() {
+    if (fd < 0) {
+        return nullptr;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quit = true;
+    }
+    wake.notify_one();
+    thread.join();
+    if (direct_fd >= 0 && ::close(direct_fd) && !err) {
+        err = "Closing failed, data might be incomplete(?)";
+    }
+    if (::close(fd) && !err) {
+        err = "Closing failed, data might be incomplete(?)";
+    }
+    fd = -1;
+    direct_fd = -1;
+    return err;
+}
+
+/* Writes everything in the queue, and quits once it's empty. */
+void cv_writer::work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [this]() { return quit || !queue.empty(); });
+        if (queue.empty()) {
+            return;
+        }
+        const piece p = queue.front();
+        queue.pop_front();
+        lock.unlock();
+        const bool ok = write_piece(p);
+        lock.lock();
+        if (!ok && !err) {
+            err = "Writing the output failed.";
+        }
+        --pending;
+        done.notify_all();
+    }
+}
+
+/* Only the middle part can go directly, if the memory and the file offset
+ * are equally misaligned. The rest goes through the page cache. */
+bool cv_writer::write_piece(const piece& p) const {
+    size_t head = p.length;
+    size_t middle = 0;
+    if (direct_fd >= 0 && 0 == (reinterpret_cast<uintptr_t>(p.data)
+                                - p.offset) % direct_align) {
+        head = std::min(p.length,
+                (direct_align - p.offset % direct_align) % direct_align);
+        middle = (p.length - head) / direct_align * direct_align;
+    }
+    const size_t rest = head + middle;
+    return pwrite_all(fd, p.data, head, p.offset)
+            && pwrite_all(direct_fd, p.data + head, middle, p.offset + head)
+            && pwrite_all(fd, p.data + rest, p.length - rest, p.offset + rest);
+}
+
+cv_mapping::~cv_mapping() {
+    close();
+}
+
+const char* cv_mapping::open(const std::string& file_out_name,
+                             const size_t bytes) {
+    assert(fd < 0 && bytes > 0);
+    fd = ::open(file_out_name.c_str(), O_RDWR | O_CREAT, 0666);
+    if (fd < 0) {
+        return "open failed. (Bad filename? Write permissions?)";
+    }
+    struct stat info;
+    if (fstat(fd, &info) || !S_ISREG(info.st_mode)) {
+        ::close(fd);
+        fd = -1;
+        return nullptr;
+    }
+    if (ftruncate64(fd, bytes)) {
+        close();
+        return "ftruncate failed. (Disk full?)";
+    }
+    void* const data = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                            MAP_SHARED, fd, 0);
+    if (MAP_FAILED == data) {
+        close();
+        return "mmap failed on the output file.";
+    }
+    map = static_cast<unsigned char*>(data);
+    size = bytes;
+    return nullptr;
+}
+
+/* munmap doesn't wait for the disk, just like fclose doesn't. */
+const char* cv_mapping::close() {
+    const char* err = nullptr;
+    if (map && munmap(map, size)) {
+        err = "munmap failed, data might be incomplete(?)";
+    }
+    if (fd >= 0 && ::close(fd) && !err) {
+        err = "Closing failed, data might be incomplete(?)";
+    }
+    map = nullptr;
+    size = 0;
+    fd = -1;
+    return err;
+}
+
+const char* cv_write_file(size_t* const begin, const size_t length,
+                const std::string& file_out_name) {
+    /* Shamelessly overwrite old data. The only collision happens at the very
+     * first operation, and here it is okay, too, because it's cached. */
+    unsigned char* data = reinterpret_cast<unsigned char*>(begin);
+    cv_default_kernel->narrow(data, begin, length);
+
+    return cv_write_bytes(data, length, file_out_name);
+}
+
+const char* cv_write_encoded(const unsigned char* const header,
+                             const unsigned char* const data,
+                             const size_t bytes,
+                             const std::string& file_out_name) {
+    FILE* fp = fopen64(file_out_name.c_str(), "wb");
+    if (!fp) {
+        return "fopen failed. (Bad filename? Write permissions?)";
+    }
+
+    const char* err = nullptr;
+    if (fwrite(header, 1, cv_header_size, fp) != cv_header_size
+            || fwrite(data, 1, bytes, fp) != bytes) {
+        err = "Writing the output failed.";
+    }
+
+    if (fclose(fp) && !err) {
+        err = "Closing failed, data might be incomplete(?)";
+    }
+    return err;
+}
+
+/* Moves the bytes of each chunk (see cv_write_compacted) next to each other,
+ * starting at 'begin'. Each chunk moves down, and only ever onto itself or
+ * the chunks before it, which are already done. */
+static unsigned char* gather_compacted(size_t* const begin, const size_t length,
+                                       const size_t cpus) {
+    unsigned char* const data = reinterpret_cast<unsigned char*>(begin);
+    const std::vector<size_t> border = compute_borders(length, cpus);
+    for (size_t i = 1; i < cpus; ++i) {
+        memmove(data + border[i], begin + border[i], border[i + 1] - border[i]);
+    }
+    return data;
+}
+
+/* For the result of cv_start_and_join_workers with 'compact': the bytes of
+ * each chunk are at the start of that chunk, so write them piece by piece. */
+const char* cv_write_compacted(const size_t* const begin, const size_t length,
+                               const size_t cpus,
+                               const std::string& file_out_name) {
+    FILE* fp = fopen64(file_out_name.c_str(), "wb");
+    if (!fp) {
+        return "fopen failed. (Bad filename? Write permissions?)";
+    }
+
+    const std::vector<size_t> border = compute_borders(length, cpus);
+    size_t written = 0;
+    for (size_t i = 0; i < cpus; ++i) {
+        written += fwrite(begin + border[i], 1, border[i + 1] - border[i], fp);
+    }
+
+    if (written != length) {
+        printf("Wrote only %ld of %ld bytes. errno is %d. ferror is %d.\n",
+                written, length, errno, ferror(fp));
+    }
+
+    if (fclose(fp)) {
+        printf("Closing failed, data might be incomplete(?)");
+    }
+    return nullptr;
+}
+
+const char* cv_write_bytes(const unsigned char* const data, const size_t length,
+                           const std::string& file_out_name) {
+    FILE* fp = fopen64(file_out_name.c_str(), "wb");
+    if (!fp) {
+        return "fopen failed. (Bad filename? Write permissions?)";
+    }
+
+    const size_t written = fwrite(data, 1, length, fp);
+
+    if (written != length) {
+        printf("Wrote only %ld of %ld bytes. errno is %d. ferror is %d.\n",
+                written, length, errno, ferror(fp));
+    }
+
+    if (fclose(fp)) {
+        printf("Closing failed, data might be incomplete(?)");
+    }
+    return nullptr;
+}
+
+
+/* ===== Library ===== */
+
+/* The colors go straight from the caller's buffers to the workers and back,
+ * no copies, no files, no printf. */
+class cv_context::impl {
+public:
+    explicit impl(const size_t threads) : pool(threads) {
+    }
+    cv_pool pool;
+    const cv_kernel* kernel = cv_default_kernel;
+    size_t tile = 512;
+};
+
+cv_context::cv_context(const size_t threads)
+        : pimpl(new impl(std::max(threads, static_cast<size_t>(1)))) {
+}
+
+cv_context::~cv_context() {
+    delete pimpl;
+}
+
+const char* cv_context::set_kernel(const char* const name) {
+    return cv_find_kernel(name, pimpl->kernel);
+}
+
+const char* cv_context::set_tile(const size_t tile) {
+    if (tile < 1) {
+        return "The tile must be at least one position wide.";
+    }
+    pimpl->tile = tile;
+    return nullptr;
+}
+
+/* Each chunk needs at least 'rounds' nodes, so short lists get fewer. */
+static const char* context_chunks(const size_t threads, const size_t length,
+                                  const size_t rounds, size_t& cpus) {
+    if (rounds < 1) {
+        return "Number of rounds must be positive.";
+    }
+    if (length < rounds) {
+        return "Must use at least #rounds many nodes in the list.";
+    }
+    cpus = std::min(threads, length / rounds);
+    return nullptr;
+}
+
+/* For cv_rounds_auto, see cv.h. */
+static size_t context_rounds(const size_t* const colors, const size_t length,
+                             const size_t rounds, const size_t* const tail,
+                             cv_pool* const pool) {
+    if (cv_rounds_auto != rounds) {
+        return rounds;
+    }
+    size_t combined = cv_combine_parallel(colors, length, pool->size(), pool);
+    const size_t most = cv_rounds_for(~size_t(0));
+    for (size_t i = 0; tail && i < most; ++i) {
+        combined |= tail[i];
+    }
+    return cv_rounds_for(combined);
+}
+
+const char* cv_context::run(size_t* const colors, const size_t length,
+                            const size_t rounds, const size_t* const tail) {
+    size_t cpus = 0;
+    if (0 == length) {
+        return nullptr;
+    }
+    const size_t actual = context_rounds(colors, length, rounds, tail,
+                                         &pimpl->pool);
+    const char* const err = context_chunks(pimpl->pool.size(), length,
+                                           actual, cpus);
+    if (err) {
+        return err;
+    }
+    cv_start_and_join_workers(colors, length, cpus, actual, pimpl->kernel,
+                              pimpl->tile, nullptr, tail, &pimpl->pool);
+    return nullptr;
+}
+
+/* The narrow representation never writes to the original colors. */
+const char* cv_context::run_narrow(const size_t* const colors,
+                                   unsigned char* const out,
+                                   const size_t length, const size_t rounds,
+                                   const size_t* const tail) {
+    size_t cpus = 0;
+    if (0 == length) {
+        return nullptr;
+    }
+    const size_t actual = context_rounds(colors, length, rounds, tail,
+                                         &pimpl->pool);
+    const char* const err = context_chunks(pimpl->pool.size(), length,
+                                           actual, cpus);
+    if (err) {
+        return err;
+    }
+    start_and_join_chunks<unsigned char>(colors, out, length, cpus, actual,
+            pimpl->kernel, pimpl->tile, tail, &pimpl->pool, false,
+            cv_chunk_done_fn_t(), nullptr, false);
+    return nullptr;
+}
+
+
+/* ===== Holistic ===== */
+
+/* Touches every page once, so that the kernel maps them now and not in the
+ * middle of a measurement. It does so in the same chunks as the job's 'cpus'
+ * threads will work on them, so the pages end up near those threads. 'unit'
+ * is how many bytes a node (or a packed group of them) takes. */
+static void prefault_parallel(cv_pool* const pool, void* const begin,
+                              const size_t bytes, const size_t unit,
+                              const size_t cpus) {
+    unsigned char* const data = static_cast<unsigned char*>(begin);
+    const std::vector<size_t> border
+            = compute_borders((bytes + unit - 1) / unit, cpus);
+    run_parallel(pool, cpus, [&border, data, bytes, unit](size_t i) {
+        const size_t to = std::min(bytes, border[i + 1] * unit);
+        for (size_t j = border[i] * unit; j < to; j += 4096) {
+            data[j] = 0;
+        }
+    });
+}
+
+cv_runner::cv_runner(const size_t threads, const std::vector<int>& pin_cpus)
+        : pool(threads, pin_cpus) {
+}
+
+cv_runner::~cv_runner() {
+    cv_deallocate(colors, colors_length * sizeof(size_t), colors_alloc);
+    cv_deallocate(small, small_length, small_alloc);
+    free(packed);
+    cv_deallocate(successors, successors_length * sizeof(size_t),
+                  successors_alloc);
+    cv_deallocate(scratch, scratch_length, scratch_alloc);
+}
+
+const char* cv_runner::reserve(const cv_opts& opts, const bool prefault) {
+    /* The fused engine doesn't need the original colors at all.
+     * The narrow and fused engines write their colors to a separate byte
+     * array, which is then already in the file format. The fused engine
+     * doesn't even need that if no-one will ever see it. The streaming
+     * engine brings its own (small) buffers. The list engine needs all of
+     * it, and more. */
+    const bool forest = cv_engine::forest == opts.engine;
+    const bool list = cv_engine::list == opts.engine || forest;
+    const bool need_colors = cv_engine::inplace == opts.engine
+            || cv_engine::narrow == opts.engine || list;
+    const bool need_small = cv_engine::narrow == opts.engine || list
+            || (cv_engine::fused == opts.engine
+                && !discards_output(opts.file_out_name));
+
+    /* Use malloc (or the like) since I don't want to use try/catch. */
+    const char* const failed = cv_alloc::plain == opts.alloc
+            ? "malloc failed!"
+            : "Allocating huge pages failed. (Are enough of them reserved?)";
+    const my_clock_t::time_point clock_begin = my_clock_t::now();
+    if (need_colors && (colors_length < opts.length
+                        || colors_alloc != opts.alloc)) {
+        cv_deallocate(colors, colors_length * sizeof(size_t), colors_alloc);
+        colors = static_cast<size_t*>(
+                cv_allocate(opts.length * sizeof(size_t), opts.alloc));
+        colors_length = colors ? opts.length : 0;
+        colors_alloc = opts.alloc;
+        if (!colors) {
+            return failed;
+        }
+        if (prefault) {
+            prefault_parallel(&pool, colors, colors_length * sizeof(size_t),
+                              sizeof(size_t), opts.cpus);
+        }
+    }
+    if (need_small && (small_length < opts.length
+                       || small_alloc != opts.alloc)) {
+        cv_deallocate(small, small_length, small_alloc);
+        small = static_cast<unsigned char*>(
+                cv_allocate(opts.length, opts.alloc));
+        small_length = small ? opts.length : 0;
+        small_alloc = opts.alloc;
+        if (!small) {
+            return failed;
+        }
+        if (prefault) {
+            prefault_parallel(&pool, small, small_length, 1, opts.cpus);
+        }
+    }
+    if (list && (successors_length < opts.length
+                 || successors_alloc != opts.alloc)) {
+        cv_deallocate(successors, successors_length * sizeof(size_t),
+                      successors_alloc);
+        successors = static_cast<size_t*>(
+                cv_allocate(opts.length * sizeof(size_t), opts.alloc));
+        successors_length = successors ? opts.length : 0;
+        successors_alloc = opts.alloc;
+        if (!successors) {
+            return failed;
+        }
+        if (prefault) {
+            prefault_parallel(&pool, successors,
+                              successors_length * sizeof(size_t),
+                              sizeof(size_t), opts.cpus);
+        }
+    }
+    if (list && (scratch_length < opts.length
+                 || scratch_alloc != opts.alloc)) {
+        cv_deallocate(scratch, scratch_length, scratch_alloc);
+        scratch = static_cast<unsigned char*>(
+                cv_allocate(opts.length, opts.alloc));
+        scratch_length = scratch ? opts.length : 0;
+        scratch_alloc = opts.alloc;
+        if (!scratch) {
+            return failed;
+        }
+        if (prefault) {
+            prefault_parallel(&pool, scratch, scratch_length, 1, opts.cpus);
+        }
+    }
+    const size_t packed_needed = (need_colors || need_small)
+            && cv_encoding::byte != opts.encoding
+            ? cv_encoded_size(opts.length, opts.encoding) : 0;
+    if (packed_length < packed_needed) {
+        free(packed);
+        packed = static_cast<unsigned char*>(malloc(packed_needed));
+        packed_length = packed ? packed_needed : 0;
+        if (!packed) {
+            return "malloc failed!";
+        }
+        if (prefault) {
+            prefault_parallel(&pool, packed, packed_length,
+                              cv_encoded_size(cv_group_nodes(opts.encoding),
+                                              opts.encoding),
+                              opts.cpus);
+        }
+    }
+    if (prefault) {
+        prefault_ms += duration_to_ms(my_clock_t::now() - clock_begin);
+    }
+    return nullptr;
+}
+
+const char* cv_runner::run(const cv_opts& opts, cv_times& times) {
+    const my_clock_t::time_point clock_init = my_clock_t::now();
+
+    const bool forest = cv_engine::forest == opts.engine;
+    const bool list = cv_engine::list == opts.engine || forest;
+    const bool use_colors = cv_engine::inplace == opts.engine
+            || cv_engine::narrow == opts.engine || list;
+    const bool use_small = cv_engine::narrow == opts.engine || list
+            || (cv_engine::fused == opts.engine
+                && !discards_output(opts.file_out_name));
+    assert(!use_colors || colors_length >= opts.length);
+    assert(!list || (successors_length >= opts.length
+                     && scratch_length >= opts.length));
+    assert(!use_small || small_length >= opts.length);
+    size_t* const arr = use_colors ? colors : nullptr;
+    unsigned char* const out = use_small ? small : nullptr;
+
+    if (opts.perf_counters && !perf_tried) {
+        perf_tried = true;
+        std::vector<long> tids(pool.size() + 1);
+        pool.run(pool.size(), [&tids](size_t i) { tids[i] = current_tid(); });
+        tids.back() = current_tid();
+        const char* const err = perf.open(tids);
+        perf_works = !err;
+        if (err) {
+            fprintf(stderr, "Warning: %s\n", err);
+        }
+    }
+    const bool counting = opts.perf_counters && perf_works;
+    std::vector<cv_counts> perf_begin;
+    std::vector<cv_counts> perf_ready;
+    std::vector<cv_counts> perf_done;
+    std::vector<cv_counts> perf_finish;
+    if (counting) {
+        perf.read(perf_begin);
+    }
+
+    /* The list's order goes through the colors' memory first. */
+    if (forest && opts.list_file_name.empty()) {
+        cv_generate_forest(successors, colors, opts.length, opts.forest_depth,
+                           opts.forest_fanout, opts.list_locality,
+                           opts.init_seed, opts.cpus, &pool);
+    } else if (list && opts.list_file_name.empty()) {
+        cv_generate_list(successors, colors, opts.length, opts.list_locality,
+                         opts.init_seed, opts.cpus, &pool);
+    } else if (list) {
+        const char* const err = cv_load_list(opts.list_file_name, successors,
+                                             opts.length, forest);
+        if (err) {
+            return err;
+        }
+    }
+
+    cv_profile profile;
+    size_t rounds = opts.rounds;
+    if (arr) {
+        const my_clock_t::time_point clock_fill = my_clock_t::now();
+        size_t combined = 0;
+        cv_fill_parallel(arr, opts.length, opts.cpus, opts.init_seed,
+                         opts.init_pattern_fn, opts.init_stream, &pool,
+                         opts.rounds_auto ? &combined : nullptr);
+        if (opts.rounds_auto) {
+            rounds = cv_rounds_for(combined);
+        }
+        profile.ns_fill = duration_to_ns(my_clock_t::now() - clock_fill);
+    }
+    times.rounds = rounds;
+
+    /* With a mapping of a byte file, the narrow and fused engines compute
+     * right in there, and the inplace engine narrows each chunk into it.
+     * The packed encodings can only start once everything is done.
+     * The streaming engine takes care of all of this on its own. */
+    const bool packing = cv_encoding::byte != opts.encoding;
+    const bool has_output = (arr || out) && cv_engine::stream != opts.engine;
+    cv_mapping mapping;
+    if (cv_write::mmap == opts.write && has_output) {
+        const size_t bytes = packing ? cv_header_size
+                + cv_encoded_size(opts.length, opts.encoding) : opts.length;
+        const char* err = mapping.open(opts.file_out_name, bytes);
+        if (err) {
+            return err;
+        }
+    }
+    unsigned char* const map = mapping.data();
+    unsigned char* const dest = map && !packing && out ? map : out;
+
+    /* Otherwise, hand each chunk to the writer as soon as it's done. */
+    cv_writer writer;
+    bool async = cv_write::sync != opts.write && !map && !packing
+            && has_output;
+    if (async) {
+        const char* err = writer.open(opts.file_out_name,
+                                      cv_write::direct == opts.write);
+        if (err) {
+            return err;
+        }
+        if (!writer.seekable()) {
+            writer.close();
+            async = false;
+        }
+    }
+    cv_chunk_done_fn_t chunk_done;
+    if (async) {
+        chunk_done = [&writer, arr, dest](size_t from, size_t to) {
+            const unsigned char* const data = dest ? dest + from
+                    : reinterpret_cast<const unsigned char*>(arr + from);
+            writer.submit(data, to - from, from);
+        };
+    }
+    const bool narrow_into_map = map && !packing && !out;
+    if (narrow_into_map) {
+        const cv_kernel* const kernel = opts.kernel;
+        const bool three = opts.three_colors;
+        chunk_done = [kernel, arr, map, three](size_t from, size_t to) {
+            /* With --three-colors, the worker already narrowed the chunk,
+             * to its start. */
+            if (three) {
+                memcpy(map + from, arr + from, to - from);
+            } else {
+                kernel->narrow(map + from, arr + from, to - from);
+            }
+        };
+    }
+    if (counting) {
+        perf.read(perf_ready);
+    }
+    const my_clock_t::time_point clock_ready = my_clock_t::now();
+
+    const char* err = nullptr;
+    if (cv_engine::fused == opts.engine) {
+        cv_start_and_join_fused(opts.init_stream, opts.init_seed, opts.length,
+                                opts.cpus, rounds, dest, opts.kernel,
+                                opts.tile, &pool, chunk_done, &profile);
+    } else if (list) {
+        cv_start_and_join_list(successors, arr, opts.length, opts.cpus,
+                               rounds, dest, scratch, &pool, chunk_done,
+                               &profile, forest);
+    } else if (cv_engine::stream == opts.engine) {
+        /* This already writes the file. */
+        err = cv_start_and_join_streaming(opts.init_stream, opts.init_seed,
+                opts.length, opts.cpus, rounds, stream_window(opts),
+                opts.file_out_name, opts.kernel, opts.tile, &pool, opts.write,
+                opts.encoding, &profile);
+    } else {
+        /* The inplace engine lets the workers narrow their own chunks. */
+        cv_start_and_join_workers(arr, opts.length, opts.cpus, rounds,
+                                  opts.kernel, opts.tile, dest, nullptr, &pool,
+                                  !dest && (!narrow_into_map
+                                            || opts.three_colors),
+                                  chunk_done, &profile, opts.three_colors);
+    }
+    const my_clock_t::time_point clock_done = my_clock_t::now();
+    if (counting) {
+        perf.read(perf_done);
+    }
+
+    uint64_t ns_pack = 0;
+    if (async) {
+        err = writer.close();
+    } else if (packing && has_output) {
+        const my_clock_t::time_point clock_pack = my_clock_t::now();
+        const unsigned char* const data = dest ? dest
+                : gather_compacted(arr, opts.length, opts.cpus);
+        const size_t bytes = cv_encoded_size(opts.length, opts.encoding);
+        unsigned char header[cv_header_size];
+        unsigned char* const into = map ? map + cv_header_size : packed;
+        assert(map || packed_length >= bytes);
+        cv_pack_parallel(into, data, opts.length, opts.encoding, opts.cpus,
+                         &pool);
+        cv_encode_header(map ? map : header, opts.encoding, opts.length,
+                         rounds, opts.init_seed);
+        ns_pack = duration_to_ns(my_clock_t::now() - clock_pack);
+        if (!map) {
+            err = cv_write_encoded(header, packed, bytes, opts.file_out_name);
+        }
+    } else if (map) {
+        /* Already there. */
+    } else if (dest) {
+        err = cv_write_bytes(dest, opts.length, opts.file_out_name);
+    } else if (arr) {
+        err = cv_write_compacted(arr, opts.length, opts.cpus,
+                                 opts.file_out_name);
+    }
+    if (map) {
+        const char* const close_err = mapping.close();
+        err = err ? err : close_err;
+    }
+    const my_clock_t::time_point clock_finish = my_clock_t::now();
+    if (counting) {
+        perf.read(perf_finish);
+    }
+
+    times.ms_init = duration_to_ms(clock_ready - clock_init);
+    times.ms_cv = duration_to_ms(clock_done - clock_ready);
+    times.ms_cleanup = duration_to_ms(clock_finish - clock_done);
+    times.ms_all = duration_to_ms(clock_finish - clock_init);
+    times.ns_fill = profile.ns_fill;
+    times.ns_borders = profile.ns_borders;
+    times.ns_cv = duration_to_ns(clock_done - clock_ready);
+    times.ns_pack = ns_pack;
+    times.ns_write = duration_to_ns(clock_finish - clock_done) - ns_pack;
+    times.ns_all = duration_to_ns(clock_finish - clock_init);
+    times.threads = profile.threads;
+    times.perf = counting;
+    for (size_t e = 0; e < cv_perf_events; ++e) {
+        times.perf_has[e] = counting && perf.has(e);
+    }
+    for (size_t t = 0; t < perf_begin.size(); ++t) {
+        add_counts(times.perf_fill, perf_begin[t], perf_ready[t]);
+        add_counts(times.perf_cv, perf_ready[t], perf_done[t]);
+        add_counts(times.perf_write, perf_done[t], perf_finish[t]);
+    }
+    /* Worker i is always run by the pool's thread i. */
+    for (size_t i = 0; counting && i < times.threads.size(); ++i) {
+        add_counts(times.threads[i].perf, perf_ready[i], perf_done[i]);
+    }
+    return err;
+}
+
+/* Minimum, mean, and maximum over all threads. */
+static void thread_stats(const std::vector<cv_thread_times>& threads,
+                         uint64_t cv_thread_times::* const which,
+                         uint64_t (&into)[3]) {
+    into[0] = into[1] = into[2] = 0;
+    if (threads.empty()) {
+        return;
+    }
+    into[0] = threads[0].*which;
+    for (const cv_thread_times& t : threads) {
+        into[0] = std::min(into[0], t.*which);
+        into[1] += t.*which;
+        into[2] = std::max(into[2], t.*which);
+    }
+    into[1] /= threads.size();
+}
+
+/* The raw counts of one phase, then IPC, bytes per cycle, LLC and dTLB
+ * misses per node, and the share of stalled cycles. NAN where the events
+ * are missing. */
+static const size_t cv_perf_columns = cv_perf_events + 5;
+static const char* const perf_column_names[cv_perf_columns] = {
+    "cycles", "instructions", "llc_misses", "dtlb_misses", "stalled_cycles",
+    "ipc", "bytes_per_cycle", "llc_misses_per_node", "dtlb_misses_per_node",
+    "stalled_share"
+};
+static const char* const perf_phase_names[] = {"fill", "cv", "write"};
+
+static void perf_columns(const cv_times& times, const cv_counts& counts,
+                         const size_t length,
+                         double (&into)[cv_perf_columns]) {
+    const bool* const has = times.perf_has;
+    double v[cv_perf_events];
+    for (size_t e = 0; e < cv_perf_events; ++e) {
+        v[e] = has[e] ? counts.value[e] : NAN;
+        into[e] = v[e];
+    }
+    /* NAN stays NAN, but 0 cycles would be infinity. */
+    const double cycles = v[0] > 0 ? v[0] : NAN;
+    into[5] = v[1] / cycles;
+    into[6] = length * sizeof(size_t) / cycles;
+    into[7] = v[2] / length;
+    into[8] = v[3] / length;
+    into[9] = v[4] / cycles;
+}
+
+static std::string perf_format(const double value, const char* const fmt) {
+    if (std::isnan(value)) {
+        return "n/a";
+    }
+    char buf[64];
+    snprintf(buf, sizeof(buf), fmt, value);
+    return buf;
+}
+
+/* One value for json and csv. Numbers are printed as they are, everything
+ * else is quoted. */
+class cv_field {
+public:
+    cv_field(const char* key, const std::string& value, bool quote = true)
+        : key(key), value(value), quote(quote) {
+    }
+    cv_field(const char* key, const char* value)
+        : key(key), value(value ? value : ""), quote(true) {
+    }
+    cv_field(const char* key, uint64_t value)
+        : key(key), value(std::to_string(value)), quote(false) {
+    }
+    /* NAN becomes null, or an empty column. */
+    cv_field(const char* key, double value, int digits = 3)
+        : key(key), value(), quote(false) {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%.*f", digits, value);
+        this->value = std::isnan(value) ? "" : buf;
+    }
+    const char* key;
+    std::string value;
+    bool quote;
+};
+
+/* Doesn't change between jobs, so it's only looked up once. */
+static const std::vector<cv_field>& cv_build_and_host() {
+    static std::vector<cv_field> fields;
+    if (!fields.empty()) {
+        return fields;
+    }
+    char hostname[256] = "";
+    if (gethostname(hostname, sizeof(hostname) - 1)) {
+        hostname[0] = '\0';
+    }
+#ifdef NDEBUG
+    fields.push_back(cv_field("build_ndebug", "true", false));
+#else
+    fields.push_back(cv_field("build_ndebug", "false", false));
+#endif
+#ifdef CV_NO_SPECIALIZE
+    fields.push_back(cv_field("build_specialize", "false", false));
+#else
+    fields.push_back(cv_field("build_specialize", "true", false));
+#endif
+#ifdef CV_HAVE_X86_KERNELS
+    fields.push_back(cv_field("build_x86_kernels", "true", false));
+#else
+    fields.push_back(cv_field("build_x86_kernels", "false", false));
+#endif
+#ifdef __VERSION__
+    fields.push_back(cv_field("build_compiler", __VERSION__));
+#else
+    fields.push_back(cv_field("build_compiler", ""));
+#endif
+    fields.push_back(cv_field("host_name", hostname));
+    fields.push_back(cv_field("host_cpu_model", cv_cpu_model()));
+    fields.push_back(cv_field("host_cpus", static_cast<uint64_t>(
+            std::thread::hardware_concurrency())));
+    return fields;
+}
+
+/* Everything for json and csv. With a default cv_times, this is just
+ * good for the keys. */
+static std::vector<cv_field> cv_fields(const cv_opts& opts,
+                                       const cv_times& times) {
+    std::string pin;
+    for (const int cpu : opts.pin_cpus) {
+        pin += (pin.empty() ? "" : ",") + std::to_string(cpu);
+    }
+    std::vector<cv_field> fields = {
+        cv_field("cpus", static_cast<uint64_t>(opts.cpus)),
+        cv_field("length", static_cast<uint64_t>(opts.length)),
+        cv_field("rounds", static_cast<uint64_t>(times.rounds ? times.rounds
+                                                 : opts.rounds)),
+        cv_field("rounds_auto", opts.rounds_auto ? "true" : "false", false),
+        cv_field("init_pattern", opts.init_stream->name),
+        cv_field("init_seed", static_cast<uint64_t>(opts.init_seed)),
+        cv_field("kernel", opts.kernel->name),
+        cv_field("engine", cv_engine_names[static_cast<int>(opts.engine)]),
+        cv_field("tile", static_cast<uint64_t>(opts.tile)),
+        cv_field("list_locality", static_cast<uint64_t>(opts.list_locality)),
+        cv_field("list_file", cv_engine::forest == opts.engine ? ""
+                 : opts.list_file_name),
+        cv_field("forest_file", cv_engine::forest == opts.engine
+                 ? opts.list_file_name : ""),
+        cv_field("forest_depth", static_cast<uint64_t>(opts.forest_depth)),
+        cv_field("forest_fanout", static_cast<uint64_t>(opts.forest_fanout)),
+        cv_field("three_colors", opts.three_colors ? "true" : "false", false),
+        cv_field("alloc", cv_alloc_names[static_cast<int>(opts.alloc)]),
+        cv_field("prefault", opts.prefault ? "true" : "false", false),
+        cv_field("write", cv_write_names[static_cast<int>(opts.write)]),
+        cv_field("output_encoding",
+                 cv_encoding_names[static_cast<int>(opts.encoding)]),
+        cv_field("memory_budget",
+                 static_cast<uint64_t>(opts.memory_budget)),
+        cv_field("length_force", opts.length_force ? "true" : "false",
+                 false),
+        cv_field("pin", pin),
+        cv_field("perf_counters", opts.perf_counters ? "true" : "false",
+                 false),
+        cv_field("jobs_file", opts.jobs_file_name),
+        cv_field("file_out", opts.file_out_name),
+    };
+    const std::vector<cv_field>& build_and_host = cv_build_and_host();
+    fields.insert(fields.end(), build_and_host.begin(), build_and_host.end());
+
+    fields.insert(fields.end(), {
+        cv_field("ms_init", static_cast<uint64_t>(times.ms_init)),
+        cv_field("ms_cv", static_cast<uint64_t>(times.ms_cv)),
+        cv_field("ms_cleanup", static_cast<uint64_t>(times.ms_cleanup)),
+        cv_field("ms_all", static_cast<uint64_t>(times.ms_all)),
+        cv_field("ns_alloc", times.ns_alloc),
+        cv_field("ns_fill", times.ns_fill),
+        cv_field("ns_borders", times.ns_borders),
+        cv_field("ns_cv", times.ns_cv),
+        cv_field("ns_pack", times.ns_pack),
+        cv_field("ns_write", times.ns_write),
+        cv_field("ns_all", times.ns_all),
+        cv_field("threads", static_cast<uint64_t>(times.threads.size())),
+    });
+    static const char* const stat_keys[][3] = {
+        {"ns_setup_min", "ns_setup_mean", "ns_setup_max"},
+        {"ns_main_min", "ns_main_mean", "ns_main_max"},
+        {"ns_finish_min", "ns_finish_mean", "ns_finish_max"},
+        {"ns_narrow_min", "ns_narrow_mean", "ns_narrow_max"},
+    };
+    uint64_t cv_thread_times::* const which[] = {
+        &cv_thread_times::ns_setup, &cv_thread_times::ns_main,
+        &cv_thread_times::ns_finish, &cv_thread_times::ns_narrow,
+    };
+    for (size_t i = 0; i < 4; ++i) {
+        uint64_t stats[3];
+        thread_stats(times.threads, which[i], stats);
+        for (size_t j = 0; j < 3; ++j) {
+            fields.push_back(cv_field(stat_keys[i][j], stats[j]));
+        }
+    }
+    const double seconds = times.ns_cv / 1e9;
+    const double nodes_per_s = seconds > 0 ? opts.length / seconds : 0;
+    fields.push_back(cv_field("nodes_per_s", nodes_per_s));
+    fields.push_back(cv_field("gb_per_s", nodes_per_s * sizeof(size_t) / 1e9));
+    if (!opts.perf_counters) {
+        return fields;
+    }
+    static std::vector<std::string> perf_keys;
+    if (perf_keys.empty()) {
+        for (const char* phase : perf_phase_names) {
+            for (const char* column : perf_column_names) {
+                perf_keys.push_back(std::string("perf_") + phase + "_"
+                                    + column);
+            }
+        }
+    }
+    const cv_counts* const phases[] = {
+        &times.perf_fill, &times.perf_cv, &times.perf_write
+    };
+    for (size_t p = 0; p < 3; ++p) {
+        double columns[cv_perf_columns];
+        perf_columns(times, *phases[p], opts.length, columns);
+        for (size_t c = 0; c < cv_perf_columns; ++c) {
+            fields.push_back(cv_field(
+                    perf_keys[p * cv_perf_columns + c].c_str(), columns[c],
+                    c < cv_perf_events ? 0 : 3));
+        }
+    }
+    return fields;
+}
+
+static void print_json_string(const std::string& str) {
+    putchar('"');
+    for (const char c : str) {
+        if ('"' == c || '\\' == c) {
+            printf("\\%c", c);
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            printf("\\u%04x", c);
+        } else {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+static void print_csv_string(const std::string& str) {
+    putchar('"');
+    for (const char c : str) {
+        if ('"' == c) {
+            putchar('"');
+        }
+        putchar(c);
+    }
+    putchar('"');
+}
+
+static void print_keys(const std::vector<cv_field>& fields) {
+    for (size_t i = 0; i < fields.size(); ++i) {
+        printf("%s%s", i ? "," : "", fields[i].key);
+    }
+    putchar('\n');
+}
+
+/* One line of json, csv, or tdl. tdl doesn't quote anything. */
+static void print_fields(const std::vector<cv_field>& fields,
+                         const std::string& format) {
+    const bool json = cv_output_format_json == format;
+    const bool tdl = cv_output_format_tdl == format;
+    if (json) {
+        putchar('{');
+    }
+    for (size_t i = 0; i < fields.size(); ++i) {
+        if (i) {
+            fputs(json ? ", " : tdl ? "\t" : ",", stdout);
+        }
+        if (json) {
+            printf("\"%s\": ", fields[i].key);
+        }
+        if (json && !fields[i].quote && fields[i].value.empty()) {
+            fputs("null", stdout);
+        } else if (!fields[i].quote || tdl) {
+            fputs(fields[i].value.c_str(), stdout);
+        } else if (json) {
+            print_json_string(fields[i].value);
+        } else {
+            print_csv_string(fields[i].value);
+        }
+    }
+    fputs(json ? "}\n" : "\n", stdout);
+}
+
+/* The memory line is only for those who asked about the memory, so that
+ * the output of a plain run stays as it always was. */
+void cv_print_header(const cv_opts& opts, const bool prefault,
+                     const size_t ms_prefault) {
+    if (cv_output_format_human == opts.output_format
+            && (opts.prefault || cv_alloc::plain != opts.alloc)) {
+        printf("Memory is %s", cv_alloc_names[static_cast<int>(opts.alloc)]);
+        if (prefault) {
+            printf(", prefaulting took %ld ms", ms_prefault);
+        }
+        printf(".\n");
+    } else if (cv_output_format_csv == opts.output_format) {
+        print_keys(cv_fields(opts, cv_times()));
+    }
+}
+
+/* The rates are for the CV phase, with the 64-bit colors as the bytes. */
+void cv_print_times(const cv_opts& opts, const cv_times& times) {
+    if (cv_output_format_none == opts.output_format) {
+        return;
+    }
+    if (cv_output_format_json == opts.output_format
+            || cv_output_format_csv == opts.output_format) {
+        print_fields(cv_fields(opts, times), opts.output_format);
+        return;
+    }
+    /* The four columns of tdl come first, as they always did. Anything new
+     * goes to the end of the line, so that scripts keep working. */
+    printf(opts.output_format.c_str(), times.ms_init, times.ms_cv,
+           times.ms_cleanup, times.ms_all);
+
+    uint64_t setup[3];
+    uint64_t main[3];
+    uint64_t finish[3];
+    uint64_t narrow[3];
+    thread_stats(times.threads, &cv_thread_times::ns_setup, setup);
+    thread_stats(times.threads, &cv_thread_times::ns_main, main);
+    thread_stats(times.threads, &cv_thread_times::ns_finish, finish);
+    thread_stats(times.threads, &cv_thread_times::ns_narrow, narrow);
+    const double seconds = times.ns_cv / 1e9;
+    const double nodes_per_s = seconds > 0 ? opts.length / seconds : 0;
+    const double gb_per_s = nodes_per_s * sizeof(size_t) / 1e9;
+
+    if (cv_output_format_human == opts.output_format) {
+        printf("In ns: alloc %lu, fill %lu, borders %lu, CV %lu, pack %lu,"
+               " write %lu, <All> %lu.\n", times.ns_alloc, times.ns_fill,
+               times.ns_borders, times.ns_cv, times.ns_pack, times.ns_write,
+               times.ns_all);
+        printf("Per thread in ns (min/mean/max): setup %lu/%lu/%lu,"
+               " main %lu/%lu/%lu, finish %lu/%lu/%lu, narrow %lu/%lu/%lu.\n",
+               setup[0], setup[1], setup[2], main[0], main[1], main[2],
+               finish[0], finish[1], finish[2],
+               narrow[0], narrow[1], narrow[2]);
+        printf("That's %.1f million nodes/s, or %.2f GB/s.\n",
+               nodes_per_s / 1e6, gb_per_s);
+        if (opts.rounds_auto) {
+            printf("--rounds auto picked %lu rounds.\n", times.rounds);
+        }
+    } else if (cv_output_format_tdl == opts.output_format) {
+        printf("\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu", times.ns_alloc,
+               times.ns_fill, times.ns_borders, times.ns_cv, times.ns_pack,
+               times.ns_write, times.ns_all);
+        for (const uint64_t* stats : {setup, main, finish, narrow}) {
+            printf("\t%lu\t%lu\t%lu", stats[0], stats[1], stats[2]);
+        }
+        printf("\t%.0f\t%.3f", nodes_per_s, gb_per_s);
+    }
+    if (!opts.perf_counters) {
+        if (cv_output_format_tdl == opts.output_format) {
+            putchar('\n');
+        }
+        return;
+    }
+
+    const char* const phase_titles[] = {"Fill", "CV", "Cleanup"};
+    const cv_counts* const phases[] = {
+        &times.perf_fill, &times.perf_cv, &times.perf_write
+    };
+    for (size_t p = 0; p < 3; ++p) {
+        double c[cv_perf_columns];
+        perf_columns(times, *phases[p], opts.length, c);
+        if (cv_output_format_tdl == opts.output_format) {
+            for (size_t i = 0; i < cv_perf_columns; ++i) {
+                printf(i < cv_perf_events ? "\t%.0f" : "\t%.3f", c[i]);
+            }
+            continue;
+        }
+        printf("%s: IPC %s, %s bytes/cycle, %s LLC and %s dTLB misses/node,"
+               " %s of the cycles stalled.\n", phase_titles[p],
+               perf_format(c[5], "%.2f").c_str(),
+               perf_format(c[6], "%.3f").c_str(),
+               perf_format(c[7], "%.4f").c_str(),
+               perf_format(c[8], "%.4f").c_str(),
+               perf_format(c[9] * 100, "%.1f%%").c_str());
+    }
+    if (cv_output_format_tdl == opts.output_format) {
+        putchar('\n');
+    } else if (times.perf_has[0] && times.perf_has[1]) {
+        printf("IPC per worker in CV:");
+        for (const cv_thread_times& t : times.threads) {
+            const double cycles = static_cast<double>(t.perf.value[0]);
+            printf(" %s", perf_format(cycles > 0 ? t.perf.value[1] / cycles
+                                      : NAN, "%.2f").c_str());
+        }
+        putchar('\n');
+    }
+}
+
+/* The MAD, scaled by 1.4826, estimates the standard deviation, even with
+ * outliers. The median's standard error is about 1.2533 times that of the
+ * mean. */
+cv_stats cv_compute_stats(std::vector<double> samples) {
+    cv_stats stats;
+    if (samples.empty()) {
+        return stats;
+    }
+    const auto median = [](std::vector<double>& v) {
+        std::sort(v.begin(), v.end());
+        const size_t n = v.size();
+        return n % 2 ? v[n / 2] : (v[n / 2 - 1] + v[n / 2]) / 2;
+    };
+    stats.median = median(samples);
+    std::vector<double> deviations;
+    for (const double sample : samples) {
+        deviations.push_back(std::fabs(sample - stats.median));
+    }
+    stats.mad = median(deviations);
+    const double sigma = 1.4826 * stats.mad;
+    stats.ci = 1.96 * 1.2533 * sigma / std::sqrt(samples.size());
+    for (const double deviation : deviations) {
+        if (deviation > 3 * sigma && sigma > 0) {
+            ++stats.outliers;
+        }
+    }
+    return stats;
+}
+
+class bench_result {
+public:
+    size_t trials = 0;
+    cv_stats cv;
+    cv_stats all;
+};
+
+/* Everything that matters for the speed, and nothing else. */
+static std::string bench_key(const cv_opts& job) {
+    char buf[512];
+    const std::string rounds = job.rounds_auto ? "auto"
+            : std::to_string(job.rounds);
+    snprintf(buf, sizeof(buf), "engine=%s kernel=%s cpus=%lu length=%lu"
+             " rounds=%s init-pattern=%s tile=%lu alloc=%s write=%s"
+             " output-encoding=%s",
+             cv_engine_names[static_cast<int>(job.engine)], job.kernel->name,
+             job.cpus, job.length, rounds.c_str(), job.init_stream->name,
+             job.tile, cv_alloc_names[static_cast<int>(job.alloc)],
+             cv_write_names[static_cast<int>(job.write)],
+             cv_encoding_names[static_cast<int>(job.encoding)]);
+    if (job.three_colors) {
+        return buf + std::string(" three-colors");
+    }
+    if (cv_engine::list == job.engine) {
+        return buf + std::string(" list-locality=")
+                + std::to_string(job.list_locality)
+                + (job.list_file_name.empty() ? ""
+                   : " list-file=" + job.list_file_name);
+    }
+    if (cv_engine::forest == job.engine) {
+        return buf + std::string(" list-locality=")
+                + std::to_string(job.list_locality)
+                + (job.list_file_name.empty()
+                   ? " forest-depth=" + std::to_string(job.forest_depth)
+                     + " forest-fanout=" + std::to_string(job.forest_fanout)
+                   : " forest-file=" + job.list_file_name);
+    }
+    return buf;
+}
+
+/* One line per job: the key, the trials, and median, MAD, CI, and outliers
+ * of CV and <All>, all tab-separated. */
+static const char* read_baseline(const std::string& file_name,
+                                 std::map<std::string, bench_result>& into) {
+    FILE* fp = fopen64(file_name.c_str(), "r");
+    if (!fp) {
+        return "Can't open the --bench-baseline file.";
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), fp)) {
+        char* const tab = strchr(line, '\t');
+        if ('#' == line[0] || !tab) {
+            continue;
+        }
+        *tab = '\0';
+        bench_result result;
+        unsigned long trials = 0;
+        unsigned long outliers[2] = {0, 0};
+        if (9 != sscanf(tab + 1, "%lu %lf %lf %lf %lu %lf %lf %lf %lu",
+                        &trials, &result.cv.median, &result.cv.mad,
+                        &result.cv.ci, &outliers[0], &result.all.median,
+                        &result.all.mad, &result.all.ci, &outliers[1])) {
+            fclose(fp);
+            return "Bad line in the --bench-baseline file.";
+        }
+        result.trials = trials;
+        result.cv.outliers = outliers[0];
+        result.all.outliers = outliers[1];
+        into[line] = result;
+    }
+    fclose(fp);
+    return nullptr;
+}
+
+static const char* write_baseline(const std::string& file_name,
+        const std::vector<std::pair<std::string, bench_result>>& results) {
+    FILE* fp = fopen64(file_name.c_str(), "w");
+    if (!fp) {
+        return "Can't open the --bench-save file.";
+    }
+    fprintf(fp, "# <key>\t<trials>\t<CV: median\tMAD\tCI\toutliers>"
+            "\t<All: the same>, in ns, see --bench in ./cv --help\n");
+    for (const auto& entry : results) {
+        const bench_result& r = entry.second;
+        fprintf(fp, "%s\t%lu\t%.0f\t%.0f\t%.0f\t%lu\t%.0f\t%.0f\t%.0f\t%lu\n",
+                entry.first.c_str(), r.trials, r.cv.median, r.cv.mad,
+                r.cv.ci, r.cv.outliers, r.all.median, r.all.mad, r.all.ci,
+                r.all.outliers);
+    }
+    if (fclose(fp)) {
+        return "Writing the --bench-save file failed.";
+    }
+    return nullptr;
+}
+
+/* Only a difference larger than both confidence intervals counts. */
+static const char* bench_verdict(const cv_stats& now, const cv_stats& base) {
+    const double diff = now.median - base.median;
+    if (std::fabs(diff) <= now.ci + base.ci) {
+        return "same";
+    }
+    return diff > 0 ? "slower" : "faster";
+}
+
+static std::vector<cv_field> bench_fields(const std::string& key,
+                                          const cv_opts& job,
+                                          const bench_result& result,
+                                          const bench_result* const base) {
+    std::vector<cv_field> fields = {
+        cv_field("job", key),
+        cv_field("trials", static_cast<uint64_t>(result.trials)),
+        cv_field("warmup", static_cast<uint64_t>(job.bench_warmup)),
+    };
+    const char* const names[2][8] = {
+        {"cv_median_ns", "cv_mad_ns", "cv_ci_ns", "cv_outliers",
+         "baseline_cv_median_ns", "baseline_cv_ci_ns", "cv_change",
+         "cv_verdict"},
+        {"all_median_ns", "all_mad_ns", "all_ci_ns", "all_outliers",
+         "baseline_all_median_ns", "baseline_all_ci_ns", "all_change",
+         "all_verdict"},
+    };
+    for (size_t m = 0; m < 2; ++m) {
+        const cv_stats& now = m ? result.all : result.cv;
+        const cv_stats* const then = !base ? nullptr
+                : m ? &base->all : &base->cv;
+        fields.push_back(cv_field(names[m][0], now.median, 0));
+        fields.push_back(cv_field(names[m][1], now.mad, 0));
+        fields.push_back(cv_field(names[m][2], now.ci, 0));
+        fields.push_back(cv_field(names[m][3],
+                                  static_cast<uint64_t>(now.outliers)));
+        fields.push_back(cv_field(names[m][4], then ? then->median : NAN, 0));
+        fields.push_back(cv_field(names[m][5], then ? then->ci : NAN, 0));
+        fields.push_back(cv_field(names[m][6], then && then->median > 0
+                ? now.median / then->median - 1 : NAN, 4));
+        fields.push_back(cv_field(names[m][7],
+                                  then ? bench_verdict(now, *then) : ""));
+    }
+    fields.push_back(cv_field("nodes_per_s", result.cv.median > 0
+            ? job.length * 1e9 / result.cv.median : 0.0));
+    const std::vector<cv_field>& build_and_host = cv_build_and_host();
+    fields.insert(fields.end(), build_and_host.begin(), build_and_host.end());
+    return fields;
+}
+
+static void print_bench_human(const std::string& key, const cv_opts& job,
+                              const bench_result& result,
+                              const bench_result* const base) {
+    printf("%s (%lu trials, %lu warm-up):\n", key.c_str(), result.trials,
+           job.bench_warmup);
+    for (size_t m = 0; m < 2; ++m) {
+        const cv_stats& now = m ? result.all : result.cv;
+        printf("  %-6s %10.3f ms +- %.3f ms (MAD %.3f ms, %lu outliers)",
+               m ? "<All>:" : "CV:", now.median / 1e6, now.ci / 1e6,
+               now.mad / 1e6, now.outliers);
+        if (!m && now.median > 0) {
+            printf(", %.1f million nodes/s", job.length * 1e3 / now.median);
+        }
+        if (base) {
+            const cv_stats& then = m ? base->all : base->cv;
+            printf(", baseline %.3f ms: %+.1f%%, %s", then.median / 1e6,
+                   then.median > 0 ? (now.median / then.median - 1) * 100 : 0,
+                   bench_verdict(now, then));
+        }
+        printf(".\n");
+    }
+}
+
+/* For a single run, the fill is usually the first touch anyway, and it's
+ * done by the same threads in the same chunks as the actual work. But when
+ * pinning, make sure that's true even for 'minstd'. */
+static bool wants_prefault(const cv_opts& opts, const size_t jobs) {
+    return opts.prefault || jobs > 1 || !opts.pin_cpus.empty();
+}
+
+const char* cv_bench(cv_runner& runner, const std::vector<cv_opts>& jobs,
+                     const cv_opts& opts, bool& regressed) {
+    std::map<std::string, bench_result> baseline;
+    const char* err = nullptr;
+    if (!opts.bench_baseline.empty()
+            && (err = read_baseline(opts.bench_baseline, baseline))) {
+        return err;
+    }
+
+    std::vector<std::pair<std::string, bench_result>> results;
+    const bool prefault = wants_prefault(opts, jobs.size());
+    for (const cv_opts& job : jobs) {
+        if ((err = runner.reserve(job, prefault))) {
+            return err;
+        }
+        std::vector<double> ns_cv;
+        std::vector<double> ns_all;
+        for (size_t t = 0; t < job.bench_warmup + job.bench_trials; ++t) {
+            cv_times times;
+            if ((err = runner.run(job, times))) {
+                return err;
+            }
+            if (t >= job.bench_warmup) {
+                ns_cv.push_back(times.ns_cv);
+                ns_all.push_back(times.ns_all);
+            }
+        }
+        bench_result result;
+        result.trials = job.bench_trials;
+        result.cv = cv_compute_stats(ns_cv);
+        result.all = cv_compute_stats(ns_all);
+
+        const std::string key = bench_key(job);
+        const auto found = baseline.find(key);
+        const bench_result* const base = baseline.end() == found ? nullptr
+                : &found->second;
+        if (base && "slower" == std::string(bench_verdict(result.cv,
+                                                          base->cv))) {
+            regressed = true;
+        }
+        const std::string& format = opts.output_format;
+        if (cv_output_format_human == format) {
+            print_bench_human(key, job, result, base);
+        } else if (cv_output_format_none != format) {
+            const std::vector<cv_field> fields
+                    = bench_fields(key, job, result, base);
+            if (results.empty() && cv_output_format_csv == format) {
+                print_keys(fields);
+            }
+            print_fields(fields, format);
+        }
+        /* Nobody should have to wait for all of them. */
+        fflush(stdout);
+        results.push_back(std::make_pair(key, result));
+    }
+
+    if (!opts.bench_save.empty()) {
+        err = write_baseline(opts.bench_save, results);
+    }
+    return err;
+}
+
+int cv_main(int argc, char **argv, bool print_errors) {
+    const my_clock_t::time_point clock_init = my_clock_t::now();
+
+    cv_opts opts;
+    const char* err = cv_try_parse(opts, argc, argv);
+    std::vector<cv_opts> jobs;
+    if (!err && opts.jobs_file_name.empty()) {
+        jobs.push_back(opts);
+    } else if (!err) {
+        err = cv_try_parse_jobs(opts, jobs);
+    }
+    if (!err) {
+        err = cv_expand_sweeps(opts.sweeps, jobs);
+    }
+    if (err) {
+        if (print_errors) {
+            printf("%s\n", err);
+        }
+        return 1;
+    }
+
+    /* Reserve for the longest job up front, so that the others can mostly
+     * reuse its buffers. But --sweep may change the engine or the
+     * allocation between jobs, so each job still reserves its own. */
+    size_t threads = 0;
+    const cv_opts* longest = &jobs[0];
+    for (const cv_opts& job : jobs) {
+        threads = std::max(threads, job.cpus);
+        if (job.length > longest->length) {
+            longest = &job;
+        }
+    }
+    cv_runner runner(threads, opts.pin_cpus);
+    const bool prefault = wants_prefault(opts, jobs.size());
+    err = runner.reserve(*longest, prefault);
+    if (err) {
+        if (print_errors) {
+            printf("%s\n", err);
+        }
+        return 2;
+    }
+    /* The setup is paid only once, so it's accounted to the first job. */
+    const my_clock_t::duration setup = my_clock_t::now() - clock_init;
+    size_t ms_setup = duration_to_ms(setup);
+    uint64_t ns_setup = duration_to_ns(setup);
+    if (opts.bench_trials) {
+        bool regressed = false;
+        err = cv_bench(runner, jobs, opts, regressed);
+        if (err) {
+            if (print_errors) {
+                printf("%s\n", err);
+            }
+            return 3;
+        }
+        return regressed ? 4 : 0;
+    }
+    cv_print_header(opts, prefault, runner.ms_prefault());
+
+    for (const cv_opts& job : jobs) {
+        cv_times times;
+        err = runner.reserve(job, prefault);
+        if (err) {
+            if (print_errors) {
+                printf("%s\n", err);
+            }
+            return 2;
+        }
+        err = runner.run(job, times);
+        if (err) {
+            if (print_errors) {
+                printf("%s\n", err);
+            }
+            return 3;
+        }
+
+        times.ms_init += ms_setup;
+        times.ms_all += ms_setup;
+        times.ns_alloc = ns_setup;
+        times.ns_all += ns_setup;
+        cv_print_times(job, times);
+        ms_setup = 0;
+        ns_setup = 0;
+    }
 
     return 0;
 }
@@ -0,0 +1,69 @@
+/* Copyright (c) 2015 Ben Wiederhake, https://github.com/BenWiederhake/cv/
+ * CC0 1.0 Universal -- So this is essentially Public Domain.
+ * Please see LICENSE or http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * Cole-Vishkin on your own colors, as a library. Build it with
+ *   make libcv.a    or    make libcv.so
+ * and link with -pthread. Nothing in here touches files or prints anything.
+ *
+ * Example:
+ *   cv_context cv(4);
+ *   std::vector<size_t> colors = ...; // Neighbors must differ.
+ *   const char* err = cv.run(colors.data(), colors.size(), 4);
+ *   // Now, each colors[i] is in 0..5, and still differs from colors[i+1].
+ */
+
+#ifndef CV_H
+#define CV_H
+
+#include <cstddef>
+
+/* The library is built with -fvisibility=hidden, so this is all it exports. */
+#if defined(__GNUC__)
+#define CV_API __attribute__((visibility("default")))
+#else
+#define CV_API
+#endif
+
+/* Pass this as 'rounds' to take exactly as many as the widest color needs,
+ * see '--rounds auto' in cv --help. That's one more pass over the colors
+ * (and the first 4 of a 'tail', since that's the most it can take). */
+static const size_t cv_rounds_auto = 0;
+
+/* Owns the worker threads, so that many runs in a row only start them
+ * once. Not thread-safe: one run at a time per context. */
+class CV_API cv_context {
+public:
+    /* Starts 'threads' workers, which sleep until there's something to do. */
+    explicit cv_context(const size_t threads = 4);
+    ~cv_context();
+    cv_context(const cv_context&) = delete;
+    cv_context& operator=(const cv_context&) = delete;
+
+    /* 'auto' (the default), 'scalar', 'avx2', or 'avx512'. All of them
+     * compute the same colors. Returns an error if the CPU can't do it. */
+    const char* set_kernel(const char* const name);
+    /* See --tile in cv --help. The default is 512. */
+    const char* set_tile(const size_t tile);
+
+    /* Runs 'rounds' rounds of Cole-Vishkin on 'colors', in-place. Node i's
+     * successor is node i+1, and the last node's is the first one, unless
+     * there's a 'tail': then these are the 'rounds' colors right after the
+     * end, e.g. of the rest of a longer list, and only read.
+     * Neighbors must have different colors, which is only checked in debug
+     * builds. Needs at least 'rounds' nodes.
+     * Returns nullptr on success, and a human-readable string otherwise. */
+    const char* run(size_t* const colors, const size_t length,
+                    const size_t rounds, const size_t* const tail = nullptr);
+    /* Like run(), but leaves 'colors' alone, and writes the new colors to
+     * 'out' instead, as one byte each. That's also faster. */
+    const char* run_narrow(const size_t* const colors, unsigned char* const out,
+                           const size_t length, const size_t rounds,
+                           const size_t* const tail = nullptr);
+
+private:
+    class impl;
+    impl* const pimpl;
+};
+
+#endif
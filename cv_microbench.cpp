@@ -0,0 +1,329 @@
+/* Copyright (c) 2015 Ben Wiederhake, https://github.com/BenWiederhake/cv/
+ * CC0 1.0 Universal -- So this is essentially Public Domain.
+ * Please see LICENSE or http://creativecommons.org/publicdomain/zero/1.0/
+ *
+ * Microbenchmarks of the pieces of cv.cpp, without the threads, the file,
+ * and everything else that makes the end-to-end numbers noisy.
+ *
+ * Compile:
+ *   g++ -std=c++11 cv_microbench.cpp -o cv-microbench -pthread -O3 \
+ *     -finline-functions -DNDEBUG
+ *
+ * Execute:
+ *   cv-microbench [--filter <substring>] [--min-time <ms>] [--format csv]
+ *
+ * Each benchmark runs until it took --min-time (default 200 ms) in total,
+ * and reports the median of its iterations. The sizes are chosen to fit
+ * into half of L1, L2, and L3, and to be way too large for L3 ('DRAM'),
+ * as far as the memory allows.
+ * Bytes are 8 per node, as for the GB/s of cv itself. The cycles come from
+ * the PMU, or from the TSC if there is none, which is marked with a '~'.
+ */
+
+#define CV_NO_MAIN
+#include "cv.cpp"
+
+#ifdef CV_HAVE_X86_KERNELS
+#include <x86intrin.h>
+#endif
+
+
+/* ===== Harness ===== */
+
+class bench_opts {
+public:
+    std::string filter;
+    size_t min_time_ms = 200;
+    bool csv = false;
+};
+
+/* Only the part between start() and stop() counts. Everything else, like
+ * restoring the input, happens outside. */
+class bench_state {
+public:
+    void start() {
+        cycles_begin = read_cycles();
+        clock_begin = my_clock_t::now();
+    }
+    void stop() {
+        const my_clock_t::time_point clock_end = my_clock_t::now();
+        ns.push_back(duration_to_ns(clock_end - clock_begin));
+        cycles.push_back(read_cycles() - cycles_begin);
+    }
+    std::vector<double> ns;
+    std::vector<double> cycles;
+    /* From the PMU, or the TSC. */
+    static cv_perf* perf;
+    static bool tsc;
+private:
+    static uint64_t read_cycles() {
+        if (perf) {
+            std::vector<cv_counts> counts;
+            perf->read(counts);
+            return counts[0].value[0];
+        }
+#ifdef CV_HAVE_X86_KERNELS
+        return __rdtsc();
+#else
+        return 0;
+#endif
+    }
+    uint64_t cycles_begin = 0;
+    my_clock_t::time_point clock_begin;
+};
+cv_perf* bench_state::perf = nullptr;
+bool bench_state::tsc = false;
+
+typedef std::function<void(bench_state&)> bench_fn_t;
+
+static void run_bench(const bench_opts& opts, const std::string& name,
+                      const size_t nodes, const bench_fn_t& fn) {
+    if (std::string::npos == name.find(opts.filter)) {
+        return;
+    }
+    /* One untimed iteration to warm up the caches and the branch predictor. */
+    bench_state warmup;
+    fn(warmup);
+    bench_state state;
+    double total = 0;
+    while (total < opts.min_time_ms * 1e6 || state.ns.size() < 3) {
+        fn(state);
+        total += state.ns.back();
+    }
+    const double ns = cv_compute_stats(state.ns).median;
+    const double cycles = cv_compute_stats(state.cycles).median;
+    const double bytes = nodes * sizeof(size_t);
+    const bool has_cycles = bench_state::perf || bench_state::tsc;
+    if (opts.csv) {
+        printf("\"%s\",%lu,%lu,%.0f,%.4f,%.3f,", name.c_str(), nodes,
+               state.ns.size(), ns, ns / nodes, bytes / ns);
+        if (has_cycles && cycles > 0) {
+            printf("%.3f\n", bytes / cycles);
+        } else {
+            printf("\n");
+        }
+        return;
+    }
+    printf("%-40s %10lu %12.0f %9.4f %8.3f", name.c_str(), state.ns.size(),
+           ns, ns / nodes, bytes / ns);
+    if (has_cycles && cycles > 0) {
+        printf(" %s%.3f\n", bench_state::perf ? " " : "~", bytes / cycles);
+    } else {
+        printf("       n/a\n");
+    }
+}
+
+
+/* ===== Inputs ===== */
+
+class bench_size {
+public:
+    const char* name;
+    size_t nodes;
+};
+
+/* Half of each cache, so that the restored input stays there, too. */
+static std::vector<bench_size> bench_sizes() {
+    size_t l1 = 32 << 10;
+    size_t l2 = 1 << 20;
+    size_t l3 = 32 << 20;
+#ifdef _SC_LEVEL1_DCACHE_SIZE
+    const long found[3] = {sysconf(_SC_LEVEL1_DCACHE_SIZE),
+                           sysconf(_SC_LEVEL2_CACHE_SIZE),
+                           sysconf(_SC_LEVEL3_CACHE_SIZE)};
+    l1 = found[0] > 0 ? found[0] : l1;
+    l2 = found[1] > 0 ? found[1] : l2;
+    l3 = found[2] > 0 ? found[2] : l3;
+#endif
+    size_t dram = std::max(8 * l3, static_cast<size_t>(256) << 20);
+#ifdef _SC_PHYS_PAGES
+    /* Some benchmarks need four arrays of this size, so leave some room. */
+    const long pages = sysconf(_SC_PHYS_PAGES);
+    if (pages > 0) {
+        dram = std::min(dram, pages * static_cast<size_t>(getpagesize()) / 16);
+    }
+#endif
+    return {
+        {"L1", l1 / 2 / sizeof(size_t)},
+        {"L2", l2 / 2 / sizeof(size_t)},
+        {"L3", l3 / 2 / sizeof(size_t)},
+        {"DRAM", dram / sizeof(size_t)},
+    };
+}
+
+/* The colors of the list, plus enough of its continuation for 'following'.
+ * Benchmarks which change the colors restore them from here. */
+class bench_input {
+public:
+    explicit bench_input(const size_t nodes) : colors(nodes + 8) {
+        fill_rnd_xorshift128plus(colors.data(), colors.size(), 42);
+        work = colors;
+    }
+    void restore() {
+        std::copy(colors.begin(), colors.end(), work.begin());
+    }
+    std::vector<size_t> colors;
+    std::vector<size_t> work;
+};
+
+static std::vector<const cv_kernel*> bench_kernels() {
+    std::vector<const cv_kernel*> kernels = {&cv_kernel_scalar};
+#ifdef CV_HAVE_X86_KERNELS
+    if (__builtin_cpu_supports("avx2")) {
+        kernels.push_back(&cv_kernel_avx2);
+    }
+    if (__builtin_cpu_supports("avx512f")
+            && __builtin_cpu_supports("avx512cd")) {
+        kernels.push_back(&cv_kernel_avx512);
+    }
+#endif
+    return kernels;
+}
+
+
+/* ===== Benchmarks ===== */
+
+static void bench_all(const bench_opts& opts) {
+    for (const bench_size& size : bench_sizes()) {
+        const size_t n = size.nodes;
+        bench_input input(n);
+        const std::string suffix = std::string("/") + size.name;
+
+        run_bench(opts, "compute_cv" + suffix, n, [&](bench_state& state) {
+            input.restore();
+            size_t* const which = input.work.data();
+            state.start();
+            for (size_t i = 0; i < n; ++i) {
+                compute_cv(which + i, which + (i + 1));
+            }
+            state.stop();
+        });
+
+        for (const cv_kernel* kernel : bench_kernels()) {
+            const std::string k = std::string("/") + kernel->name;
+            run_bench(opts, "round" + k + suffix, n,
+                      [&](bench_state& state) {
+                input.restore();
+                state.start();
+                kernel->round(input.work.data(), n);
+                state.stop();
+            });
+            std::vector<unsigned char> bytes(n);
+            run_bench(opts, "narrow" + k + suffix, n,
+                      [&](bench_state& state) {
+                state.start();
+                kernel->narrow(bytes.data(), input.colors.data(), n);
+                state.stop();
+            });
+            /* Also with '--tile 1', which is the specialized pipeline. */
+            for (const size_t tile : {512, 1}) {
+                const std::string t = tile == 1 ? "/tile:1" : "";
+                for (size_t rounds = 1; rounds <= 6; ++rounds) {
+                    const std::string name = "run_chunk" + k + "/rounds:"
+                            + std::to_string(rounds) + t + suffix;
+                    run_bench(opts, name, n, [&](bench_state& state) {
+                        input.restore();
+                        size_t* const arr = input.work.data();
+                        const std::vector<size_t> following(arr + n,
+                                arr + n + rounds);
+                        state.start();
+                        run_chunk(arr, arr, n, following, kernel, tile);
+                        state.stop();
+                    });
+                }
+            }
+            /* The same, with the 6-to-3 reduction right behind. Like in the
+             * inplace engine, that includes narrowing to bytes. The context
+             * doesn't matter for the speed. */
+            const size_t context[6] = {0, 1, 0, 1, 0, 1};
+            run_bench(opts, "run_chunk" + k + "/rounds:4/three" + suffix, n,
+                      [&](bench_state& state) {
+                input.restore();
+                size_t* const arr = input.work.data();
+                const std::vector<size_t> following(arr + n, arr + n + 4);
+                state.start();
+                run_chunk(arr, arr, n, following, kernel, 512, nullptr,
+                          context);
+                state.stop();
+            });
+        }
+
+        /* The first round of the list engine, to compare with 'narrow'
+         * above (which is the same with locality 1, minus the gather).
+         * Generating the lists is slow, so only for those that will run. */
+        std::vector<size_t> next;
+        std::vector<size_t> temp;
+        std::vector<unsigned char> out;
+        for (const size_t locality : {1, 64, 4096, 0}) {
+            const std::string name = "list_round/locality:"
+                    + (locality ? std::to_string(locality) : "all") + suffix;
+            if (std::string::npos == name.find(opts.filter)) {
+                continue;
+            }
+            next.resize(n);
+            temp.resize(n);
+            out.resize(n);
+            cv_generate_list(next.data(), temp.data(), n, locality, 42, 1);
+            run_bench(opts, name, n, [&](bench_state& state) {
+                state.start();
+                list_round(out.data(), input.colors.data(), next.data(), 0,
+                           n);
+                state.stop();
+            });
+        }
+
+        run_bench(opts, "fill/minstd" + suffix, n, [&](bench_state& state) {
+            state.start();
+            fill_rnd_minstd(input.work.data(), n, 1);
+            state.stop();
+        });
+        run_bench(opts, "fill/xorshift128plus" + suffix, n,
+                  [&](bench_state& state) {
+            state.start();
+            fill_rnd_xorshift128plus(input.work.data(), n, 1);
+            state.stop();
+        });
+    }
+}
+
+int main(int argc, char **argv) {
+    bench_opts opts;
+    for (int i = 1; i < argc; ++i) {
+        const bool has_arg = i + 1 < argc;
+        if (std::string("--filter") == argv[i] && has_arg) {
+            opts.filter = argv[++i];
+        } else if (std::string("--min-time") == argv[i] && has_arg) {
+            opts.min_time_ms = strtoul(argv[++i], nullptr, 10);
+        } else if (std::string("--format") == argv[i] && has_arg
+                   && std::string("csv") == argv[i + 1]) {
+            opts.csv = true;
+            ++i;
+        } else {
+            printf("Usage: %s [--filter <substring>] [--min-time <ms>]"
+                   " [--format csv]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    cv_perf perf;
+    if (!perf.open(std::vector<long>(1, current_tid())) && perf.has(0)) {
+        bench_state::perf = &perf;
+    } else {
+#ifdef CV_HAVE_X86_KERNELS
+        bench_state::tsc = true;
+#endif
+    }
+#ifndef NDEBUG
+    printf("Compiled without NDEBUG, so these numbers are meaningless.\n");
+#endif
+
+    if (opts.csv) {
+        printf("benchmark,nodes,iterations,ns_per_iteration,ns_per_node,"
+               "gb_per_s,bytes_per_cycle\n");
+    } else {
+        printf("%-40s %10s %12s %9s %8s %10s\n", "Benchmark", "Iterations",
+               "ns/iter", "ns/node", "GB/s", "bytes/cyc");
+    }
+    bench_all(opts);
+    return 0;
+}